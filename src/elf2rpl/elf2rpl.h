@@ -0,0 +1,17 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace elf2rpl
+{
+
+/**
+ * Convert the .elf file at src to an RPX (or an RPL if isRpl is set) held in out.
+ */
+bool
+convertElf(const std::string &src,
+           bool isRpl,
+           std::vector<uint8_t> &out);
+
+} // namespace elf2rpl
@@ -0,0 +1,87 @@
+#include "compressor.h"
+
+#include <cstdio>
+#include <vector>
+#include <zlib.h>
+
+Compressor::~Compressor()
+{
+   if (!mThread.joinable()) {
+      return;
+   }
+
+   // Segments still queued are finished before exiting
+   {
+      std::lock_guard<std::mutex> lock { mMutex };
+      mStopping = true;
+      mWakeup.notify_one();
+   }
+   mThread.join();
+}
+
+void
+Compressor::add(const std::string &path)
+{
+   std::lock_guard<std::mutex> lock { mMutex };
+   if (!mThread.joinable()) {
+      mThread = std::thread { [this]() { run(); } };
+   }
+
+   mQueue.push_back(path);
+   mWakeup.notify_one();
+}
+
+static bool
+compressFile(const std::string &path,
+             const std::string &gzPath)
+{
+   auto in = fopen(path.c_str(), "rb");
+   if (!in) {
+      return false;
+   }
+
+   auto out = gzopen(gzPath.c_str(), "wb");
+   if (!out) {
+      fclose(in);
+      return false;
+   }
+
+   std::vector<char> buffer(256 * 1024);
+   auto ok = true;
+   size_t read;
+   while (ok && (read = fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+      ok = gzwrite(out, buffer.data(), static_cast<unsigned>(read)) == static_cast<int>(read);
+   }
+
+   ok = !ferror(in) && ok;
+   ok = gzclose(out) == Z_OK && ok;
+   fclose(in);
+   return ok;
+}
+
+void
+Compressor::run()
+{
+   while (true) {
+      std::string path;
+
+      {
+         std::unique_lock<std::mutex> lock { mMutex };
+         mWakeup.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+         if (mQueue.empty()) {
+            break;
+         }
+
+         path = std::move(mQueue.front());
+         mQueue.pop_front();
+      }
+
+      auto gzPath = path + ".gz";
+      if (compressFile(path, gzPath)) {
+         remove(path.c_str());
+      } else {
+         fprintf(stderr, "udplogserver: failed to compress %s, keeping it uncompressed\n", path.c_str());
+         remove(gzPath.c_str());
+      }
+   }
+}
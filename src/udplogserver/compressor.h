@@ -0,0 +1,30 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Gzips rotated log segments on a background thread, replacing each file
+ * with a .gz of the same name once it has been written out completely.
+ */
+class Compressor
+{
+public:
+   ~Compressor();
+
+   // Queues path for compression, the thread is started on first use.
+   void
+   add(const std::string &path);
+
+private:
+   void
+   run();
+
+   std::thread mThread;
+   std::mutex mMutex;
+   std::condition_variable mWakeup;
+   std::deque<std::string> mQueue;
+   bool mStopping = false;
+};
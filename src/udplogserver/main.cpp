@@ -2,6 +2,7 @@
 #include <winsock2.h>
 #else
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -9,37 +10,166 @@
 #include <unistd.h>
 #endif
 
-#include <iostream>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
+#include <excmd.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #define SERVER_PORT 4405
 
-int main(int argc, char **argv)
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#else
+typedef int socket_t;
+#endif
+
+// Datagrams received per recvmmsg call
+constexpr auto ReceiveBatchSize = 64;
+// Largest UDP payload, long lines are sent as one datagram
+constexpr auto MaxDatagramSize = 64 * 1024;
+// Kernel receive queue, so a burst of logging doesn't overflow it between wakeups
+constexpr auto SocketReceiveBufferSize = 8 * 1024 * 1024;
+// Output a subscriber may fall behind by before it's disconnected
+constexpr auto SubscriberBufferSize = 4 * 1024 * 1024;
+#ifdef _WIN32
+// How often a blocked receive thread checks for Ctrl+C, in microseconds
+constexpr auto StopCheckInterval = 250 * 1000;
+#endif
+
+// Lock-free, so safe to set from the signal handler and read on every receive thread
+static std::atomic<bool> sStopRequested { false };
+// Set with sStopRequested when a receive thread stopped on an error
+static std::atomic<bool> sReceiveFailed { false };
+
+#ifndef _WIN32
+// Written to by the signal handler, so every receive thread wakes up
+static int sStopPipe[2] = { -1, -1 };
+#endif
+
+static void
+onStopSignal(int)
 {
-   struct sockaddr_in addr;
-   unsigned short port = SERVER_PORT;
+   sStopRequested = true;
 
-   if (argc == 2) {
-      port = atoi(argv[1]);
+#ifndef _WIN32
+   if (sStopPipe[1] >= 0) {
+      char c = 0;
+      (void) !write(sStopPipe[1], &c, 1);
    }
+#endif
+}
+
+/**
+ * A receive thread can't go on, stop the others as well so main() returns an error.
+ */
+static void
+failReceive(const char *what)
+{
+   fprintf(stderr, "udplogserver: %s failed: %s\n", what, strerror(errno));
+   sReceiveFailed = true;
+   onStopSignal(0);
+}
 
+static void
+installStopHandlers()
+{
 #ifdef _WIN32
-   WSADATA wsaData;
-   if (WSAStartup(MAKEWORD(2, 2), &wsaData) == SOCKET_ERROR) {
-      return -1;
+   signal(SIGINT, onStopSignal);
+   signal(SIGTERM, onStopSignal);
+#else
+   if (pipe(sStopPipe) < 0) {
+      sStopPipe[0] = sStopPipe[1] = -1;
+   }
+
+   // No SA_RESTART, so a blocking epoll_wait/select returns with EINTR
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = onStopSignal;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+#endif
+}
+
+static void
+setReceiveBufferSize(socket_t fd, int size)
+{
+#ifdef SO_RCVBUFFORCE
+   // Goes past net.core.rmem_max when privileged
+   if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, (const char *) &size, sizeof(size)) == 0) {
+      return;
    }
 #endif
 
-   // Create socket
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof(size));
+}
+
+static void
+enableReceiveTimestamps(socket_t fd)
+{
+#ifdef SO_TIMESTAMPNS
+   // Stamped by the kernel on arrival, so our scheduling delays don't show up in them
+   int on = 1;
+   setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, (const char *) &on, sizeof(on));
+#endif
+}
+
+static void
+enableDropCounter(socket_t fd)
+{
+#ifdef SO_RXQ_OVFL
+   // Every datagram carries the number the socket has dropped so far
+   int on = 1;
+   setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, (const char *) &on, sizeof(on));
+#endif
+}
+
+// Nanoseconds since the epoch
+static uint64_t
+currentTimestamp()
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void
+closeSocket(socket_t fd)
+{
+#ifdef _WIN32
+   closesocket(fd);
+#else
+   close(fd);
+#endif
+}
+
+/**
+ * A non-blocking socket bound to port, or an invalid socket on failure.
+ * With reusePort several sockets can share the port and the kernel spreads
+ * senders across them by address hash.
+ */
+static bool
+openSocket(unsigned short port, bool timestamps, bool reusePort, socket_t &result)
+{
    auto fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 #ifdef _WIN32
    if (fd == INVALID_SOCKET) {
-      WSACleanup();
 #else
    if (fd < 0) {
 #endif
-      return -1;
+      return false;
    }
 
    // Set non blocking
@@ -51,56 +181,466 @@ int main(int argc, char **argv)
    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 #endif
 
+   setReceiveBufferSize(fd, SocketReceiveBufferSize);
+   enableDropCounter(fd);
+   if (timestamps) {
+      enableReceiveTimestamps(fd);
+   }
+
+#ifdef SO_REUSEPORT
+   if (reusePort) {
+      int on = 1;
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &on, sizeof(on)) < 0) {
+         closeSocket(fd);
+         return false;
+      }
+   }
+#endif
+
    // Bind socket
+   struct sockaddr_in addr;
    memset(&addr, 0, sizeof(addr));
    addr.sin_family = AF_INET;
    addr.sin_addr.s_addr = htonl(INADDR_ANY);
    addr.sin_port = htons(port);
    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-#ifdef _WIN32
-      closesocket(fd);
-      WSACleanup();
-#else
-      close(fd);
+      closeSocket(fd);
+      return false;
+   }
+
+   result = fd;
+   return true;
+}
+
+static void
+queueDatagram(OutputWriter &writer, unsigned receiver, SourceIndex &sources, const struct sockaddr_in &from, uint64_t timestamp, const char *buffer, int size)
+{
+   auto source = sources.lookup(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+
+   // Payloads are text, anything after a NUL is dropped
+   auto end = static_cast<const char *>(memchr(buffer, 0, size));
+   writer.write(receiver, source, timestamp, buffer, end ? end - buffer : size);
+}
+
+#ifdef __linux__
+/**
+ * Block in epoll until the socket is readable, then drain it in recvmmsg batches.
+ */
+static void
+receiveLoop(socket_t fd, OutputWriter &writer, unsigned receiver, SourceTable &sourceTable, bool timestamps)
+{
+   SourceIndex sources { sourceTable };
+
+   auto epfd = epoll_create1(0);
+   if (epfd < 0) {
+      failReceive("epoll_create1");
+      return;
+   }
+
+   struct epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN;
+   event.data.fd = fd;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      failReceive("epoll_ctl");
+      close(epfd);
+      return;
+   }
+
+   // Never read, it stays readable once a stop signal arrives
+   if (sStopPipe[0] >= 0) {
+      event.data.fd = sStopPipe[0];
+      epoll_ctl(epfd, EPOLL_CTL_ADD, sStopPipe[0], &event);
+   }
+
+   std::vector<char> buffers(ReceiveBatchSize * MaxDatagramSize);
+   struct mmsghdr msgs[ReceiveBatchSize];
+   struct iovec iovecs[ReceiveBatchSize];
+   struct sockaddr_in addrs[ReceiveBatchSize];
+   union {
+      char buffer[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+      struct cmsghdr align;
+   } controls[ReceiveBatchSize];
+   memset(msgs, 0, sizeof(msgs));
+   for (auto i = 0; i < ReceiveBatchSize; ++i) {
+      iovecs[i].iov_base = buffers.data() + i * MaxDatagramSize;
+      iovecs[i].iov_len = MaxDatagramSize;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_control = controls[i].buffer;
+   }
+
+   while (!sStopRequested) {
+      struct epoll_event ready;
+      auto numEvents = epoll_wait(epfd, &ready, 1, -1);
+      if (numEvents < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         failReceive("epoll_wait");
+         break;
+      }
+
+      while (true) {
+         // recvmmsg overwrites msg_namelen and msg_controllen with what each datagram used
+         for (auto i = 0; i < ReceiveBatchSize; ++i) {
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+         }
+
+         auto count = recvmmsg(fd, msgs, ReceiveBatchSize, MSG_DONTWAIT, NULL);
+         if (count <= 0) {
+            break;
+         }
+
+         // Used when the kernel didn't stamp a datagram
+         auto batchTimestamp = timestamps ? currentTimestamp() : 0;
+
+         for (auto i = 0; i < count; ++i) {
+            auto timestamp = batchTimestamp;
+            for (auto cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+               if (cmsg->cmsg_level != SOL_SOCKET) {
+                  continue;
+               }
+
+               if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                  struct timespec ts;
+                  memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                  timestamp = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+               }
+#ifdef SO_RXQ_OVFL
+               else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                  uint32_t drops;
+                  memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                  writer.setKernelDrops(receiver, drops);
+               }
 #endif
-      return -1;
+            }
+
+            queueDatagram(writer, receiver, sources, addrs[i], timestamp, static_cast<char *>(iovecs[i].iov_base), msgs[i].msg_len);
+         }
+         writer.notify();
+
+         if (count < ReceiveBatchSize) {
+            break;
+         }
+      }
    }
 
-   // Receive data
-   char buffer[2048];
-   bool running = true;
+   close(epfd);
+}
+#else
+/**
+ * Block in select until the socket is readable, then drain it.
+ */
+static void
+receiveLoop(socket_t fd, OutputWriter &writer, unsigned receiver, SourceTable &sourceTable, bool timestamps)
+{
+   SourceIndex sources { sourceTable };
+   std::vector<char> buffer(MaxDatagramSize);
 
-   while (running) {
+   while (!sStopRequested) {
       fd_set fdsRead;
       FD_ZERO(&fdsRead);
       FD_SET(fd, &fdsRead);
+      auto maxFd = fd;
+#ifdef _WIN32
+      // There is no stop pipe and the console handler doesn't interrupt select, so
+      // wake up regularly to see whether a stop was requested
+      struct timeval stopCheck = { 0, StopCheckInterval };
+      auto timeout = &stopCheck;
+#else
+      struct timeval *timeout = NULL;
+      if (sStopPipe[0] >= 0) {
+         FD_SET(sStopPipe[0], &fdsRead);
+         maxFd = std::max(fd, sStopPipe[0]);
+      }
+#endif
 
-      struct timeval tv;
-      tv.tv_sec = 0;
-      tv.tv_usec = 10000;
+      if (select(maxFd + 1, &fdsRead, NULL, NULL, timeout) < 1 || !FD_ISSET(fd, &fdsRead)) {
+         continue;
+      }
 
-      if (select(fd + 1, &fdsRead, NULL, NULL, &tv) == 1) {
+      while (true) {
          struct sockaddr_in from;
 #ifdef _WIN32
          int fromLen = sizeof(from);
 #else
          socklen_t fromLen = sizeof(from);
 #endif
-         int recvd = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &fromLen);
+         int recvd = recvfrom(fd, buffer.data(), MaxDatagramSize, 0, (struct sockaddr *) &from, &fromLen);
+         if (recvd <= 0) {
+            break;
+         }
+
+         queueDatagram(writer, receiver, sources, from, timestamps ? currentTimestamp() : 0, buffer.data(), recvd);
+      }
+      writer.notify();
+   }
+}
+#endif
+
+/**
+ * Parse a numeric option, printing an error unless it's a whole number
+ * between minimum and maximum.
+ */
+static bool
+parseNumber(excmd::option_state &options,
+            const char *name,
+            unsigned long long minimum,
+            unsigned long long maximum,
+            unsigned long long &value)
+{
+   auto text = options.get<std::string>(name);
+   char *end = nullptr;
+   errno = 0;
+   value = strtoull(text.c_str(), &end, 10);
+   if (end == text.c_str() || *end != '\0' || text[0] == '-' || errno == ERANGE || value < minimum || value > maximum) {
+      fprintf(stderr, "Invalid --%s %s, expected a number between %llu and %llu\n", name, text.c_str(), minimum, maximum);
+      return false;
+   }
+   return true;
+}
+
+int main(int argc, char **argv)
+{
+   excmd::parser parser;
+   excmd::option_state options;
+   using excmd::description;
+   using excmd::value;
+
+   try {
+      parser.global_options()
+         .add_option("H,help",
+                     description { "Show help." })
+         .add_option("flush-interval",
+                     description { "Milliseconds received output may be held back to batch writes (default 10)" },
+                     value<std::string> {})
+         .add_option("threads",
+                     description { "Receive threads, each with its own socket on the port (default 1)" },
+                     value<std::string> {})
+         .add_option("ring-size",
+                     description { "KiB of output queued per receive thread before datagrams are dropped (default 8192)" },
+                     value<std::string> {})
+         .add_option("output",
+                     description { "Append to this file instead of writing to stdout" },
+                     value<std::string> {})
+         .add_option("rotate-size",
+                     description { "Rotate output files once they reach this many MiB, rotated files are gzipped" },
+                     value<std::string> {})
+         .add_option("rotate-interval",
+                     description { "Rotate output files after this many minutes, rotated files are gzipped" },
+                     value<std::string> {})
+         .add_option("line-timeout",
+                     description { "Milliseconds to wait for the rest of a line split across datagrams (default 100)" },
+                     value<std::string> {})
+         .add_option("timestamps",
+                     description { "Start every line with the time it was received" })
+         .add_option("filter",
+                     description { "Only write lines matching this regular expression, use | to give several" },
+                     value<std::string> {})
+         .add_option("exclude",
+                     description { "Don't write lines matching this regular expression, use | to give several" },
+                     value<std::string> {})
+         .add_option("highlight",
+                     description { "Highlight --filter matches with ANSI colours" })
+         .add_option("prefix",
+                     description { "Start every line with the sender's [ip:port]" })
+         .add_option("split",
+                     description { "Write each sender to its own file, {ip} and {port} in the pattern are replaced by its address" },
+                     value<std::string> {})
+         .add_option("symbols",
+                     description { "Append <symbol+offset> to addresses in this RPX/RPL's text and data" },
+                     value<std::string> {})
+         .add_option("serve",
+                     description { "Serve the output to local subscribers on unix:<path> or tcp:<port> (localhost only)" },
+                     value<std::string> {})
+         .add_option("stats",
+                     description { "Print per-sender statistics every N seconds, 0 to only print them on exit" },
+                     value<std::string> {});
+
+      parser.default_command()
+         .add_argument("port",
+                       description { "UDP port to listen on (default 4405)" },
+                       value<std::string> {});
+
+      options = parser.parse(argc, argv);
+   } catch (excmd::exception &ex) {
+      fprintf(stderr, "Error parsing options: %s\n", ex.what());
+      return -1;
+   }
+
+   if (options.has("help")) {
+      printf("%s [options] [port]\n", argv[0]);
+      printf("%s\n", parser.format_help(argv[0]).c_str());
+      return 0;
+   }
+
+   unsigned short port = SERVER_PORT;
+   OutputOptions outputOptions;
+   unsigned long long number;
+
+   if (options.has("port")) {
+      if (!parseNumber(options, "port", 1, 65535, number)) {
+         return -1;
+      }
+      port = static_cast<unsigned short>(number);
+   }
+
+   if (options.has("threads")) {
+      if (!parseNumber(options, "threads", 1, 256, number)) {
+         return -1;
+      }
+      outputOptions.receivers = static_cast<unsigned>(number);
+#ifndef SO_REUSEPORT
+      if (outputOptions.receivers > 1) {
+         fprintf(stderr, "--threads needs SO_REUSEPORT, which this platform doesn't have\n");
+         return -1;
+      }
+#endif
+   }
+
+   if (options.has("ring-size")) {
+      // Has to hold at least one of the largest datagrams
+      if (!parseNumber(options, "ring-size", 128, 1024 * 1024, number)) {
+         return -1;
+      }
+      outputOptions.ringSize = static_cast<size_t>(number) * 1024;
+   }
+
+   if (options.has("flush-interval")) {
+      if (!parseNumber(options, "flush-interval", 0, 60 * 1000, number)) {
+         return -1;
+      }
+      outputOptions.flushInterval = std::chrono::milliseconds { number };
+   }
+
+   if (options.has("output")) {
+      outputOptions.path = options.get<std::string>("output");
+   }
+
+   if (options.has("rotate-size")) {
+      if (!parseNumber(options, "rotate-size", 1, 1024 * 1024, number)) {
+         return -1;
+      }
+      outputOptions.rotate.maxSize = number * 1024 * 1024;
+   }
+
+   if (options.has("rotate-interval")) {
+      if (!parseNumber(options, "rotate-interval", 1, 366 * 24 * 60, number)) {
+         return -1;
+      }
+      outputOptions.rotate.interval = std::chrono::minutes { number };
+   }
+
+   if (options.has("line-timeout")) {
+      if (!parseNumber(options, "line-timeout", 0, 60 * 1000, number)) {
+         return -1;
+      }
+      outputOptions.lineTimeout = std::chrono::milliseconds { number };
+   }
+
+   std::string error;
+   if (options.has("filter") && !outputOptions.filter.add(options.get<std::string>("filter"), error)) {
+      fprintf(stderr, "Invalid --filter: %s\n", error.c_str());
+      return -1;
+   }
+
+   if (options.has("exclude") && !outputOptions.exclude.add(options.get<std::string>("exclude"), error)) {
+      fprintf(stderr, "Invalid --exclude: %s\n", error.c_str());
+      return -1;
+   }
+
+   SymbolTable symbols;
+   if (options.has("symbols")) {
+      if (!symbols.load(options.get<std::string>("symbols"))) {
+         return -1;
+      }
+      outputOptions.symbols = &symbols;
+   }
+
+   outputOptions.highlight = options.has("highlight");
+   outputOptions.timestamps = options.has("timestamps");
+   outputOptions.prefix = options.has("prefix");
+
+   if (options.has("split")) {
+      outputOptions.splitPattern = options.get<std::string>("split");
+   }
+
+   if (options.has("stats")) {
+      if (!parseNumber(options, "stats", 0, 24 * 60 * 60, number)) {
+         return -1;
+      }
+      outputOptions.statsInterval = std::chrono::seconds { number };
+      outputOptions.printStats = true;
+   }
+
+#ifdef _WIN32
+   WSADATA wsaData;
+   if (WSAStartup(MAKEWORD(2, 2), &wsaData) == SOCKET_ERROR) {
+      return -1;
+   }
+#endif
 
-         if (recvd > 0) {
-            buffer[recvd] = 0;
-            std::cout << buffer;
-            std::cout.flush();
+   // One socket per receive thread, all bound to the same port
+   std::vector<socket_t> sockets;
+   for (auto i = 0u; i < outputOptions.receivers; ++i) {
+      socket_t fd;
+      if (!openSocket(port, outputOptions.timestamps, outputOptions.receivers > 1, fd)) {
+         for (auto other : sockets) {
+            closeSocket(other);
          }
+#ifdef _WIN32
+         WSACleanup();
+#endif
+         return -1;
       }
+      sockets.push_back(fd);
    }
 
+   // Declared before the writer, so it's still there for the writer's last flush
+   std::unique_ptr<SubscriberServer> subscribers;
+   if (options.has("serve")) {
+      subscribers.reset(SubscriberServer::open(options.get<std::string>("serve"), SubscriberBufferSize));
+      if (!subscribers) {
+         for (auto fd : sockets) {
+            closeSocket(fd);
+         }
+#ifdef _WIN32
+         WSACleanup();
+#endif
+         return -1;
+      }
+
+#ifndef _WIN32
+      // A subscriber going away must not kill the server
+      signal(SIGPIPE, SIG_IGN);
+#endif
+      outputOptions.subscribers = subscribers.get();
+   }
+
+   // Receive data, written out by the writer thread
+   installStopHandlers();
+   SourceTable sources;
+   OutputWriter writer { sources, outputOptions };
+
+   std::vector<std::thread> receivers;
+   for (auto i = 1u; i < sockets.size(); ++i) {
+      receivers.emplace_back([&, i]() { receiveLoop(sockets[i], writer, i, sources, outputOptions.timestamps); });
+   }
+   receiveLoop(sockets[0], writer, 0, sources, outputOptions.timestamps);
+
+   for (auto &thread : receivers) {
+      thread.join();
+   }
+   writer.stop();
+
+   for (auto fd : sockets) {
+      closeSocket(fd);
+   }
 #ifdef _WIN32
-   closesocket(fd);
    WSACleanup();
-#else
-   close(fd);
 #endif
-   return 0;
+   return sReceiveFailed ? -1 : 0;
 }
@@ -0,0 +1,508 @@
+#include "matcher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// The DFA cache is dropped and rebuilt when it grows past this many states
+static constexpr size_t MaxDfaStates = 4096;
+
+/**
+ * Recursive descent over one pattern, building Thompson NFA fragments.
+ */
+class Matcher::Parser
+{
+public:
+   Parser(Matcher &matcher, const std::string &pattern) :
+      mMatcher(matcher),
+      mPattern(pattern)
+   {
+   }
+
+   bool
+   parse(Fragment &fragment,
+         std::string &error)
+   {
+      fragment = parseAlternation();
+      if (mError.empty() && mPos != mPattern.size()) {
+         mError = "unmatched )";
+      }
+
+      error = mError;
+      return mError.empty();
+   }
+
+private:
+   bool
+   atEnd() const
+   {
+      return mPos >= mPattern.size();
+   }
+
+   Fragment
+   empty()
+   {
+      auto state = mMatcher.addState(NfaState::Split);
+      return Fragment { state, { { state, 0 } } };
+   }
+
+   Fragment
+   chars(const std::bitset<256> &chars)
+   {
+      auto state = mMatcher.addState(NfaState::Char);
+      mMatcher.mNfa[state].chars = chars;
+      return Fragment { state, { { state, 0 } } };
+   }
+
+   Fragment
+   parseAlternation()
+   {
+      auto fragment = parseConcatenation();
+      while (mError.empty() && !atEnd() && mPattern[mPos] == '|') {
+         ++mPos;
+         auto other = parseConcatenation();
+         auto split = mMatcher.addState(NfaState::Split, fragment.start, other.start);
+         fragment.start = split;
+         fragment.outs.insert(fragment.outs.end(), other.outs.begin(), other.outs.end());
+      }
+      return fragment;
+   }
+
+   Fragment
+   parseConcatenation()
+   {
+      auto fragment = empty();
+      while (mError.empty() && !atEnd() && mPattern[mPos] != '|' && mPattern[mPos] != ')') {
+         auto next = parseRepeat();
+         mMatcher.patch(fragment, next.start);
+         fragment.outs = std::move(next.outs);
+      }
+      return fragment;
+   }
+
+   Fragment
+   parseRepeat()
+   {
+      auto fragment = parseAtom();
+      while (mError.empty() && !atEnd()) {
+         auto op = mPattern[mPos];
+         if (op != '*' && op != '+' && op != '?') {
+            break;
+         }
+         ++mPos;
+
+         auto split = mMatcher.addState(NfaState::Split, fragment.start);
+         if (op == '*') {
+            mMatcher.patch(fragment, split);
+            fragment = Fragment { split, { { split, 1 } } };
+         } else if (op == '+') {
+            mMatcher.patch(fragment, split);
+            fragment.outs = { { split, 1 } };
+         } else {
+            fragment.start = split;
+            fragment.outs.push_back({ split, 1 });
+         }
+      }
+      return fragment;
+   }
+
+   Fragment
+   parseAtom()
+   {
+      auto c = mPattern[mPos++];
+      std::bitset<256> set;
+
+      switch (c) {
+      case '(':
+      {
+         auto fragment = parseAlternation();
+         if (mError.empty() && (atEnd() || mPattern[mPos] != ')')) {
+            mError = "missing )";
+         }
+         ++mPos;
+         return fragment;
+      }
+      case '*':
+      case '+':
+      case '?':
+         mError = std::string { "nothing to repeat before " } + c;
+         return empty();
+      case '{':
+         // Bounded repeats aren't supported, rather than matching them literally
+         mError = "{m,n} repeats are not supported";
+         return empty();
+      case '.':
+         set.set();
+         return chars(set);
+      case '^':
+      {
+         auto state = mMatcher.addState(NfaState::LineStart);
+         return Fragment { state, { { state, 0 } } };
+      }
+      case '$':
+      {
+         auto state = mMatcher.addState(NfaState::LineEnd);
+         return Fragment { state, { { state, 0 } } };
+      }
+      case '[':
+         parseClass(set);
+         return chars(set);
+      case '\\':
+         parseEscape(set);
+         return chars(set);
+      default:
+         set.set(static_cast<unsigned char>(c));
+         return chars(set);
+      }
+   }
+
+   void
+   parseEscape(std::bitset<256> &set)
+   {
+      if (atEnd()) {
+         mError = "trailing \\";
+         return;
+      }
+
+      auto c = mPattern[mPos++];
+      auto negate = c == 'D' || c == 'W' || c == 'S';
+      switch (c) {
+      case 'd':
+      case 'D':
+         for (auto i = '0'; i <= '9'; ++i) {
+            set.set(i);
+         }
+         break;
+      case 'w':
+      case 'W':
+         for (auto i = 0; i < 256; ++i) {
+            if (isalnum(i) || i == '_') {
+               set.set(i);
+            }
+         }
+         break;
+      case 's':
+      case 'S':
+         for (auto i : { ' ', '\t', '\r', '\n', '\v', '\f' }) {
+            set.set(i);
+         }
+         break;
+      case 't':
+         set.set('\t');
+         break;
+      case 'r':
+         set.set('\r');
+         break;
+      case 'n':
+         set.set('\n');
+         break;
+      default:
+         // Escaped punctuation is literal, other letters and digits (\b, \1, ...)
+         // would be silently different from what the pattern means elsewhere
+         if (isalnum(static_cast<unsigned char>(c))) {
+            mError = std::string { "unsupported escape \\" } + c;
+            return;
+         }
+         set.set(static_cast<unsigned char>(c));
+         break;
+      }
+
+      if (negate) {
+         set.flip();
+      }
+   }
+
+   void
+   parseClass(std::bitset<256> &set)
+   {
+      auto negate = !atEnd() && mPattern[mPos] == '^';
+      if (negate) {
+         ++mPos;
+      }
+
+      // A ] right after the opening bracket is a literal
+      auto first = true;
+      while (!atEnd() && (first || mPattern[mPos] != ']')) {
+         first = false;
+         auto c = static_cast<unsigned char>(mPattern[mPos++]);
+
+         if (c == '\\') {
+            std::bitset<256> escaped;
+            parseEscape(escaped);
+            set |= escaped;
+            continue;
+         }
+
+         if (mPos + 1 < mPattern.size() && mPattern[mPos] == '-' && mPattern[mPos + 1] != ']') {
+            auto last = static_cast<unsigned char>(mPattern[mPos + 1]);
+            mPos += 2;
+            if (last < c) {
+               mError = "invalid range in []";
+               return;
+            }
+            for (auto i = static_cast<int>(c); i <= last; ++i) {
+               set.set(i);
+            }
+         } else {
+            set.set(c);
+         }
+      }
+
+      if (atEnd()) {
+         mError = "missing ]";
+         return;
+      }
+      ++mPos;
+
+      if (negate) {
+         set.flip();
+      }
+   }
+
+   Matcher &mMatcher;
+   const std::string &mPattern;
+   size_t mPos = 0;
+   std::string mError;
+};
+
+Matcher::Matcher()
+{
+   mMatch = addState(NfaState::Match);
+}
+
+bool
+Matcher::add(const std::string &pattern,
+             std::string &error)
+{
+   Fragment fragment;
+   Parser parser { *this, pattern };
+   if (!parser.parse(fragment, error)) {
+      return false;
+   }
+
+   patch(fragment, mMatch);
+   mStart = mStart < 0 ? fragment.start : addState(NfaState::Split, fragment.start, mStart);
+
+   reset(mSearch);
+   reset(mAnchored);
+   mSearch.unanchored = true;
+   mAnchored.unanchored = false;
+   return true;
+}
+
+int
+Matcher::addState(NfaState::Type type,
+                  int out,
+                  int out1)
+{
+   NfaState state;
+   state.type = type;
+   state.out = out;
+   state.out1 = out1;
+   mNfa.push_back(state);
+   return static_cast<int>(mNfa.size() - 1);
+}
+
+void
+Matcher::patch(const Fragment &fragment,
+               int target)
+{
+   for (auto &out : fragment.outs) {
+      if (out.second == 0) {
+         mNfa[out.first].out = target;
+      } else {
+         mNfa[out.first].out1 = target;
+      }
+   }
+}
+
+/**
+ * Every state reachable from states without consuming a character; the
+ * assertions are only passed where they hold.
+ */
+std::vector<int>
+Matcher::closure(std::vector<int> states,
+                 bool atLineStart,
+                 bool atLineEnd)
+{
+   if (mVisited.size() != mNfa.size()) {
+      mVisited.assign(mNfa.size(), 0);
+      mVisitGeneration = 0;
+   }
+   ++mVisitGeneration;
+
+   std::vector<int> result;
+   while (!states.empty()) {
+      auto index = states.back();
+      states.pop_back();
+      if (index < 0 || mVisited[index] == mVisitGeneration) {
+         continue;
+      }
+
+      mVisited[index] = mVisitGeneration;
+      result.push_back(index);
+
+      auto &state = mNfa[index];
+      if (state.type == NfaState::Split) {
+         states.push_back(state.out1);
+         states.push_back(state.out);
+      } else if ((state.type == NfaState::LineStart && atLineStart) ||
+                 (state.type == NfaState::LineEnd && atLineEnd)) {
+         states.push_back(state.out);
+      }
+   }
+
+   std::sort(result.begin(), result.end());
+   return result;
+}
+
+void
+Matcher::reset(Dfa &dfa)
+{
+   dfa.states.clear();
+   dfa.index.clear();
+   dfa.generation++;
+   dfa.lineStart = -1;
+   dfa.start = -1;
+}
+
+int
+Matcher::intern(Dfa &dfa,
+                std::vector<int> states)
+{
+   auto it = dfa.index.find(states);
+   if (it != dfa.index.end()) {
+      return it->second;
+   }
+
+   if (dfa.states.size() >= MaxDfaStates) {
+      reset(dfa);
+   }
+
+   DfaState state;
+   state.accepting = std::binary_search(states.begin(), states.end(), mMatch);
+   memset(state.next, -1, sizeof(state.next));
+   state.nfaStates = states;
+
+   auto index = static_cast<int>(dfa.states.size());
+   dfa.states.push_back(std::move(state));
+   dfa.index.emplace(std::move(states), index);
+   return index;
+}
+
+int
+Matcher::step(Dfa &dfa,
+              int state,
+              unsigned char c)
+{
+   auto next = dfa.states[state].next[c];
+   if (next >= 0) {
+      return next;
+   }
+
+   std::vector<int> targets;
+   for (auto index : dfa.states[state].nfaStates) {
+      if (mNfa[index].type == NfaState::Char && mNfa[index].chars.test(c)) {
+         targets.push_back(mNfa[index].out);
+      }
+   }
+
+   // An unanchored search can start a new match at every position
+   if (dfa.unanchored) {
+      targets.push_back(mStart);
+   }
+
+   auto generation = dfa.generation;
+   next = intern(dfa, closure(std::move(targets), false, false));
+
+   // intern() may have dropped the whole cache, state included
+   if (dfa.generation == generation) {
+      dfa.states[state].next[c] = next;
+   }
+   return next;
+}
+
+bool
+Matcher::acceptsAtEnd(Dfa &dfa,
+                      int state,
+                      bool atLineStart)
+{
+   // Only the line start state of an empty line depends on atLineStart, that isn't cached
+   if (atLineStart) {
+      auto states = closure(dfa.states[state].nfaStates, true, true);
+      return std::binary_search(states.begin(), states.end(), mMatch);
+   }
+
+   auto &cached = dfa.states[state].acceptsAtEnd;
+   if (cached < 0) {
+      auto states = closure(dfa.states[state].nfaStates, false, true);
+      cached = std::binary_search(states.begin(), states.end(), mMatch);
+   }
+   return cached != 0;
+}
+
+bool
+Matcher::search(const char *line,
+                size_t size)
+{
+   if (mStart < 0) {
+      return false;
+   }
+
+   if (mSearch.lineStart < 0) {
+      mSearch.lineStart = intern(mSearch, closure({ mStart }, true, false));
+   }
+
+   auto state = mSearch.lineStart;
+   if (mSearch.states[state].accepting) {
+      return true;
+   }
+
+   for (size_t i = 0; i < size; ++i) {
+      state = step(mSearch, state, static_cast<unsigned char>(line[i]));
+      if (mSearch.states[state].accepting) {
+         return true;
+      }
+   }
+
+   return acceptsAtEnd(mSearch, state, size == 0);
+}
+
+bool
+Matcher::matchAt(const char *line,
+                 size_t size,
+                 size_t offset,
+                 size_t &length)
+{
+   if (mStart < 0) {
+      return false;
+   }
+
+   auto &start = offset == 0 ? mAnchored.lineStart : mAnchored.start;
+   if (start < 0) {
+      start = intern(mAnchored, closure({ mStart }, offset == 0, false));
+   }
+
+   auto state = start;
+   auto found = mAnchored.states[state].accepting;
+   length = 0;
+
+   auto i = offset;
+   for (; i < size; ++i) {
+      state = step(mAnchored, state, static_cast<unsigned char>(line[i]));
+      if (mAnchored.states[state].nfaStates.empty()) {
+         return found;
+      }
+
+      if (mAnchored.states[state].accepting) {
+         found = true;
+         length = i + 1 - offset;
+      }
+   }
+
+   if (acceptsAtEnd(mAnchored, state, size == 0)) {
+      found = true;
+      length = size - offset;
+   }
+   return found;
+}
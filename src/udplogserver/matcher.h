@@ -0,0 +1,132 @@
+#pragma once
+#include <bitset>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Matches lines against a set of regular expressions, compiled together into
+ * one automaton so every line is scanned once however many patterns there are.
+ *
+ * Patterns are compiled to an NFA, which is turned into a DFA lazily as lines
+ * are searched. Supported syntax: literals, ., [classes], \d \w \s and their
+ * negations, \t \r \n, escaped punctuation, ^ $, groups, |, *, + and ?.
+ * Other escapes and {m,n} repeats are rejected.
+ */
+class Matcher
+{
+public:
+   Matcher();
+
+   // Adds pattern as another alternative, false with error set when it doesn't parse.
+   bool
+   add(const std::string &pattern,
+       std::string &error);
+
+   bool
+   empty() const
+   {
+      return mStart < 0;
+   }
+
+   // Whether any pattern matches anywhere in the line, which excludes its newline.
+   bool
+   search(const char *line,
+          size_t size);
+
+   // Longest match starting at line + offset, false if there is none.
+   bool
+   matchAt(const char *line,
+           size_t size,
+           size_t offset,
+           size_t &length);
+
+private:
+   struct NfaState
+   {
+      enum Type
+      {
+         Char,
+         Split,
+         LineStart,
+         LineEnd,
+         Match,
+      };
+
+      Type type;
+      int out;
+      int out1;
+      std::bitset<256> chars;
+   };
+
+   struct Fragment
+   {
+      int start;
+      // Unconnected exits, (state, 0 for out or 1 for out1)
+      std::vector<std::pair<int, int>> outs;
+   };
+
+   struct DfaState
+   {
+      std::vector<int> nfaStates;
+      bool accepting;
+      // Whether a $ lets it accept, -1 until first needed
+      int acceptsAtEnd = -1;
+      // -1 until the transition is first taken
+      int next[256];
+   };
+
+   struct Dfa
+   {
+      bool unanchored;
+      // Bumped whenever the cache is dropped
+      unsigned generation = 0;
+      std::vector<DfaState> states;
+      std::map<std::vector<int>, int> index;
+      int lineStart = -1;
+      int start = -1;
+   };
+
+   class Parser;
+
+   int
+   addState(NfaState::Type type,
+            int out = -1,
+            int out1 = -1);
+
+   void
+   patch(const Fragment &fragment,
+         int target);
+
+   std::vector<int>
+   closure(std::vector<int> states,
+           bool atLineStart,
+           bool atLineEnd);
+
+   void
+   reset(Dfa &dfa);
+
+   int
+   intern(Dfa &dfa,
+          std::vector<int> states);
+
+   int
+   step(Dfa &dfa,
+        int state,
+        unsigned char c);
+
+   bool
+   acceptsAtEnd(Dfa &dfa,
+                int state,
+                bool atLineStart);
+
+   std::vector<NfaState> mNfa;
+   int mStart = -1;
+   int mMatch;
+
+   Dfa mSearch;
+   Dfa mAnchored;
+   std::vector<int> mVisited;
+   int mVisitGeneration = 0;
+};
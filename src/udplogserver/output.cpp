@@ -0,0 +1,132 @@
+#include "output.h"
+#include "compressor.h"
+#include "subscribers.h"
+
+#include <ctime>
+
+OutputFile::OutputFile(FILE *file) :
+   mFile(file)
+{
+}
+
+OutputFile::~OutputFile()
+{
+   flush();
+
+   if (mOwned && mFile) {
+      fclose(mFile);
+   }
+}
+
+OutputFile *
+OutputFile::open(const std::string &path,
+                 const RotateOptions &rotate,
+                 Compressor *compressor)
+{
+   auto file = fopen(path.c_str(), "ab");
+   if (!file) {
+      return nullptr;
+   }
+
+   auto output = new OutputFile { file };
+   output->mOwned = true;
+   output->mPath = path;
+   output->mRotate = rotate;
+   output->mCompressor = compressor;
+   output->mOpened = std::chrono::system_clock::now();
+
+   // Appending to an existing file counts towards its size limit
+   fseek(file, 0, SEEK_END);
+   auto size = ftell(file);
+   output->mSize = size > 0 ? static_cast<uint64_t>(size) : 0;
+   return output;
+}
+
+void
+OutputFile::append(const char *data,
+                   size_t size)
+{
+   mPending.insert(mPending.end(), data, data + size);
+}
+
+void
+OutputFile::flush()
+{
+   if (!mPending.empty()) {
+      if (mFile) {
+         fwrite(mPending.data(), 1, mPending.size(), mFile);
+         fflush(mFile);
+      }
+
+      // Only whole lines are ever pending, so subscribers never see a partial one
+      if (mSubscribers) {
+         mSubscribers->publish(mPending.data(), mPending.size());
+      }
+
+      mSize += mPending.size();
+      mPending.clear();
+   }
+
+   if (rotationDue()) {
+      rotate();
+   }
+}
+
+bool
+OutputFile::rotationDue() const
+{
+   // Never rotate out an empty segment
+   if (!mOwned || mSize == 0) {
+      return false;
+   }
+
+   if (mRotate.maxSize && mSize >= mRotate.maxSize) {
+      return true;
+   }
+
+   return mRotate.interval.count() && std::chrono::system_clock::now() - mOpened >= mRotate.interval;
+}
+
+static bool
+fileExists(const std::string &path)
+{
+   auto file = fopen(path.c_str(), "rb");
+   if (file) {
+      fclose(file);
+   }
+   return file != nullptr;
+}
+
+void
+OutputFile::rotate()
+{
+   if (mFile) {
+      fclose(mFile);
+   }
+
+   // Named after the time the segment was started, numbered when several start within a second
+   char suffix[32];
+   auto opened = std::chrono::system_clock::to_time_t(mOpened);
+   strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", localtime(&opened));
+
+   auto segment = mPath + suffix;
+   for (auto i = 1; fileExists(segment) || fileExists(segment + ".gz"); ++i) {
+      segment = mPath + suffix + "." + std::to_string(i);
+   }
+
+   if (rename(mPath.c_str(), segment.c_str()) == 0) {
+      if (mCompressor) {
+         mCompressor->add(segment);
+      }
+   } else {
+      fprintf(stderr, "udplogserver: could not rotate %s to %s\n", mPath.c_str(), segment.c_str());
+   }
+
+   mFile = fopen(mPath.c_str(), "ab");
+   if (!mFile) {
+      fprintf(stderr, "udplogserver: could not reopen %s, its output is dropped\n", mPath.c_str());
+   }
+
+   mSize = 0;
+   mOpened = std::chrono::system_clock::now();
+}
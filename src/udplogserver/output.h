@@ -0,0 +1,77 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class Compressor;
+class SubscriberServer;
+
+struct RotateOptions
+{
+   // Start a new segment once the file reaches this many bytes, 0 for no limit
+   uint64_t maxSize = 0;
+   // Start a new segment once the file has been open this long, 0 for no limit
+   std::chrono::minutes interval { 0 };
+};
+
+/**
+ * A destination for log output, writes are gathered until flush().
+ *
+ * Files opened by path can be rotated: the finished segment is renamed to
+ * path.YYYYmmdd-HHMMSS and handed to the Compressor.
+ */
+class OutputFile
+{
+public:
+   // Doesn't take ownership of file
+   explicit OutputFile(FILE *file);
+
+   ~OutputFile();
+
+   // Opens path for appending, nullptr on failure
+   static OutputFile *
+   open(const std::string &path,
+        const RotateOptions &rotate,
+        Compressor *compressor);
+
+   void
+   append(const char *data,
+          size_t size);
+
+   // Everything written is also published to subscribers
+   void
+   setSubscribers(SubscriberServer *subscribers)
+   {
+      mSubscribers = subscribers;
+   }
+
+   // Writes out pending data, then rotates if the segment is due.
+   void
+   flush();
+
+   size_t
+   pending() const
+   {
+      return mPending.size();
+   }
+
+private:
+   bool
+   rotationDue() const;
+
+   void
+   rotate();
+
+   FILE *mFile;
+   bool mOwned = false;
+   std::vector<char> mPending;
+   SubscriberServer *mSubscribers = nullptr;
+
+   std::string mPath;
+   RotateOptions mRotate;
+   Compressor *mCompressor = nullptr;
+   uint64_t mSize = 0;
+   std::chrono::system_clock::time_point mOpened;
+};
@@ -0,0 +1,84 @@
+#include "ringbuffer.h"
+
+#include <cstring>
+
+RingBuffer::RingBuffer(size_t capacity)
+{
+   size_t size = 64;
+   while (size < capacity) {
+      size <<= 1;
+   }
+
+   mBuffer.resize(size);
+   mMask = size - 1;
+}
+
+bool
+RingBuffer::push(uint32_t tag,
+                 uint64_t timestamp,
+                 const char *data,
+                 size_t size)
+{
+   auto head = mHead.load(std::memory_order_relaxed);
+   auto tail = mTail.load(std::memory_order_acquire);
+   auto needed = recordSize(size);
+   auto offset = head & mMask;
+   auto contiguous = mBuffer.size() - offset;
+
+   // Records never wrap, the rest of the buffer is skipped when one doesn't fit
+   auto skip = needed > contiguous ? contiguous : 0;
+   if (needed > mBuffer.size() || head + skip + needed - tail > mBuffer.size()) {
+      return false;
+   }
+
+   if (skip) {
+      // Records are 4 byte aligned, so there's always room for the marker
+      uint32_t marker = WrapMarker;
+      memcpy(mBuffer.data() + offset, &marker, sizeof(marker));
+      head += skip;
+      offset = 0;
+   }
+
+   auto length = static_cast<uint32_t>(size);
+   memcpy(mBuffer.data() + offset, &length, sizeof(length));
+   memcpy(mBuffer.data() + offset + sizeof(length), &tag, sizeof(tag));
+   memcpy(mBuffer.data() + offset + sizeof(length) + sizeof(tag), &timestamp, sizeof(timestamp));
+   memcpy(mBuffer.data() + offset + HeaderSize, data, size);
+   mHead.store(head + needed, std::memory_order_release);
+   return true;
+}
+
+const char *
+RingBuffer::front(uint32_t &tag,
+                  uint64_t &timestamp,
+                  size_t &size)
+{
+   auto tail = mTail.load(std::memory_order_relaxed);
+   auto head = mHead.load(std::memory_order_acquire);
+   if (tail == head) {
+      return nullptr;
+   }
+
+   uint32_t length;
+   memcpy(&length, mBuffer.data() + (tail & mMask), sizeof(length));
+   if (length == WrapMarker) {
+      tail += mBuffer.size() - (tail & mMask);
+      mTail.store(tail, std::memory_order_release);
+      memcpy(&length, mBuffer.data(), sizeof(length));
+   }
+
+   auto record = mBuffer.data() + (tail & mMask);
+   memcpy(&tag, record + sizeof(length), sizeof(tag));
+   memcpy(&timestamp, record + sizeof(length) + sizeof(tag), sizeof(timestamp));
+   size = length;
+   return record + HeaderSize;
+}
+
+void
+RingBuffer::pop()
+{
+   auto tail = mTail.load(std::memory_order_relaxed);
+   uint32_t length;
+   memcpy(&length, mBuffer.data() + (tail & mMask), sizeof(length));
+   mTail.store(tail + recordSize(length), std::memory_order_release);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Lock-free single producer, single consumer queue of variable sized records.
+ */
+class RingBuffer
+{
+public:
+   // capacity is rounded up to a power of two
+   explicit RingBuffer(size_t capacity);
+
+   // Producer: copies the record in, false if there isn't room for it.
+   bool
+   push(uint32_t tag,
+        uint64_t timestamp,
+        const char *data,
+        size_t size);
+
+   // Consumer: the oldest record, or nullptr when empty. Valid until pop().
+   const char *
+   front(uint32_t &tag,
+         uint64_t &timestamp,
+         size_t &size);
+
+   void
+   pop();
+
+   bool
+   empty() const
+   {
+      return mHead.load() == mTail.load();
+   }
+
+private:
+   static constexpr uint32_t WrapMarker = UINT32_MAX;
+
+   // Length, tag and timestamp, followed by the data
+   static constexpr size_t HeaderSize = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+   static size_t
+   recordSize(size_t size)
+   {
+      return (HeaderSize + size + 3) & ~static_cast<size_t>(3);
+   }
+
+   std::vector<char> mBuffer;
+   size_t mMask;
+
+   // Free-running byte counters, each only written by one side. Padded onto
+   // their own cache lines rather than alignas(64), which heap allocation
+   // only honours from C++17.
+   char mPadding0[64];
+   std::atomic<size_t> mHead { 0 };
+   char mPadding1[64 - sizeof(std::atomic<size_t>)];
+   std::atomic<size_t> mTail { 0 };
+   char mPadding2[64 - sizeof(std::atomic<size_t>)];
+};
@@ -0,0 +1,104 @@
+#include "sources.h"
+
+#include <cstdio>
+
+Source::Source(uint32_t id, uint32_t ip, uint16_t port) :
+   id(id),
+   ip(ip),
+   port(port)
+{
+   char buffer[32];
+   snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u:%u",
+            (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, port);
+   name = buffer;
+}
+
+static size_t
+hashKey(uint64_t key)
+{
+   // Fibonacci hashing, the top bits are the best mixed
+   return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+Source *
+SourceTable::add(uint32_t ip,
+                 uint16_t port)
+{
+   auto key = (static_cast<uint64_t>(ip) << 16) | port;
+   std::lock_guard<std::mutex> lock { mMutex };
+
+   auto &source = mByAddress[key];
+   if (!source) {
+      mSources.emplace_back(static_cast<uint32_t>(mSources.size()), ip, port);
+      source = &mSources.back();
+   }
+   return source;
+}
+
+Source *
+SourceTable::get(uint32_t id)
+{
+   std::lock_guard<std::mutex> lock { mMutex };
+   return id < mSources.size() ? &mSources[id] : nullptr;
+}
+
+std::vector<Source *>
+SourceTable::all()
+{
+   std::lock_guard<std::mutex> lock { mMutex };
+   std::vector<Source *> sources;
+   for (auto &source : mSources) {
+      sources.push_back(&source);
+   }
+   return sources;
+}
+
+SourceIndex::SourceIndex(SourceTable &table) :
+   mTable(table),
+   mSlots(64, Slot { 0, nullptr })
+{
+}
+
+Source *
+SourceIndex::lookup(uint32_t ip,
+                    uint16_t port)
+{
+   auto key = (static_cast<uint64_t>(ip) << 16) | port;
+   auto mask = mSlots.size() - 1;
+
+   for (auto i = hashKey(key) & mask; ; i = (i + 1) & mask) {
+      auto &slot = mSlots[i];
+      if (slot.source && slot.key == key) {
+         return slot.source;
+      }
+
+      if (!slot.source) {
+         auto source = mTable.add(ip, port);
+         slot.key = key;
+         slot.source = source;
+         if (++mUsed * 2 > mSlots.size()) {
+            grow();
+         }
+         return source;
+      }
+   }
+}
+
+void
+SourceIndex::grow()
+{
+   std::vector<Slot> slots(mSlots.size() * 2, Slot { 0, nullptr });
+   auto mask = slots.size() - 1;
+
+   for (auto &slot : mSlots) {
+      if (slot.source) {
+         auto i = hashKey(slot.key) & mask;
+         while (slots[i].source) {
+            i = (i + 1) & mask;
+         }
+         slots[i] = slot;
+      }
+   }
+
+   mSlots.swap(slots);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A console sending to us, identified by its IP:port.
+ */
+struct Source
+{
+   Source(uint32_t id, uint32_t ip, uint16_t port);
+
+   uint32_t id;
+   uint32_t ip;
+   uint16_t port;
+   std::string name; // "ip:port"
+
+   // Updated by the receive thread, read by the stats report
+   std::atomic<uint64_t> datagrams { 0 };
+   std::atomic<uint64_t> bytes { 0 };
+   std::atomic<uint64_t> dropped { 0 };
+};
+
+/**
+ * Every source seen so far, shared by the receive threads and the writer.
+ */
+class SourceTable
+{
+public:
+   // The source for ip:port, created on first use; host byte order
+   Source *
+   add(uint32_t ip,
+       uint16_t port);
+
+   Source *
+   get(uint32_t id);
+
+   std::vector<Source *>
+   all();
+
+private:
+   std::mutex mMutex;
+   std::deque<Source> mSources;
+   std::unordered_map<uint64_t, Source *> mByAddress;
+};
+
+/**
+ * A receive thread's lock-free view of the SourceTable, it only goes to the
+ * table when a sender shows up that this thread hasn't seen before.
+ */
+class SourceIndex
+{
+public:
+   explicit SourceIndex(SourceTable &table);
+
+   // ip and port in host byte order
+   Source *
+   lookup(uint32_t ip,
+          uint16_t port);
+
+private:
+   struct Slot
+   {
+      uint64_t key;
+      Source *source;
+   };
+
+   void
+   grow();
+
+   SourceTable &mTable;
+
+   // Open addressing with linear probing, kept at most half full
+   std::vector<Slot> mSlots;
+   size_t mUsed = 0;
+};
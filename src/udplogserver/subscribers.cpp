@@ -0,0 +1,316 @@
+#include "subscribers.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+SubscriberServer::SubscriberServer(int listenFd,
+                                   const std::string &unixPath,
+                                   size_t bufferSize) :
+   mListenFd(listenFd),
+   mUnixPath(unixPath),
+   mBufferSize(bufferSize)
+{
+#ifndef _WIN32
+   if (pipe(mWakePipe) == 0) {
+      fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+      fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+   }
+
+   mThread = std::thread { [this]() { run(); } };
+#endif
+}
+
+SubscriberServer::~SubscriberServer()
+{
+#ifndef _WIN32
+   mStopping = true;
+   wake();
+   mThread.join();
+
+   // Whatever still fits into the socket buffers is delivered
+   for (auto &subscriber : mSubscribers) {
+      if (!subscriber->tooSlow) {
+         send(*subscriber);
+      }
+      close(subscriber->fd);
+   }
+
+   close(mListenFd);
+   close(mWakePipe[0]);
+   close(mWakePipe[1]);
+
+   if (!mUnixPath.empty()) {
+      unlink(mUnixPath.c_str());
+   }
+#endif
+}
+
+SubscriberServer *
+SubscriberServer::open(const std::string &address,
+                       size_t bufferSize)
+{
+#ifdef _WIN32
+   fprintf(stderr, "udplogserver: subscribers are not supported on Windows\n");
+   return nullptr;
+#else
+   int fd = -1;
+   std::string unixPath;
+
+   if (address.compare(0, 5, "unix:") == 0) {
+      unixPath = address.substr(5);
+
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (unixPath.empty() || unixPath.size() >= sizeof(addr.sun_path)) {
+         fprintf(stderr, "udplogserver: invalid socket path %s\n", unixPath.c_str());
+         return nullptr;
+      }
+      memcpy(addr.sun_path, unixPath.c_str(), unixPath.size());
+
+      // A socket file left behind by an earlier run would make bind fail, but
+      // anything that isn't a socket is most likely a mistyped path
+      struct stat st;
+      if (lstat(unixPath.c_str(), &st) == 0) {
+         if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "udplogserver: %s exists and is not a socket\n", unixPath.c_str());
+            return nullptr;
+         }
+         unlink(unixPath.c_str());
+      }
+
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+         close(fd);
+         fd = -1;
+      }
+   } else if (address.compare(0, 4, "tcp:") == 0) {
+      auto port = atoi(address.c_str() + 4);
+
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons(port);
+
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd >= 0) {
+         int on = 1;
+         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+         if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+         }
+      }
+   } else {
+      fprintf(stderr, "udplogserver: invalid subscriber address %s, expected unix:<path> or tcp:<port>\n", address.c_str());
+      return nullptr;
+   }
+
+   if (fd < 0 || listen(fd, 16) < 0) {
+      fprintf(stderr, "udplogserver: could not listen on %s: %s\n", address.c_str(), strerror(errno));
+      if (fd >= 0) {
+         close(fd);
+      }
+      return nullptr;
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+   return new SubscriberServer { fd, unixPath, bufferSize };
+#endif
+}
+
+void
+SubscriberServer::publish(const char *data,
+                          size_t size)
+{
+   if (mCount.load(std::memory_order_relaxed) == 0) {
+      return;
+   }
+
+   auto queued = false;
+   {
+      std::lock_guard<std::mutex> lock { mMutex };
+      for (auto &subscriber : mSubscribers) {
+         if (subscriber->tooSlow) {
+            continue;
+         }
+
+         if (subscriber->pending.size() - subscriber->sent + size > mBufferSize) {
+            subscriber->tooSlow = true;
+         } else {
+            subscriber->pending.insert(subscriber->pending.end(), data, data + size);
+         }
+         queued = true;
+      }
+   }
+
+   if (queued) {
+      wake();
+   }
+}
+
+void
+SubscriberServer::wake()
+{
+#ifndef _WIN32
+   char c = 0;
+   (void) !write(mWakePipe[1], &c, 1);
+#endif
+}
+
+#ifndef _WIN32
+void
+SubscriberServer::accept()
+{
+   while (true) {
+      auto fd = ::accept(mListenFd, NULL, NULL);
+      if (fd < 0) {
+         return;
+      }
+
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+      auto subscriber = new Subscriber();
+      subscriber->fd = fd;
+      subscriber->name = "subscriber " + std::to_string(++mNextId);
+      fprintf(stderr, "udplogserver: %s connected\n", subscriber->name.c_str());
+
+      std::lock_guard<std::mutex> lock { mMutex };
+      mSubscribers.emplace_back(subscriber);
+      mCount = mSubscribers.size();
+   }
+}
+
+// Sends as much as the socket takes, false when the subscriber has gone away
+bool
+SubscriberServer::send(Subscriber &subscriber)
+{
+   while (subscriber.sent < subscriber.pending.size()) {
+      auto sent = ::send(subscriber.fd, subscriber.pending.data() + subscriber.sent,
+                         subscriber.pending.size() - subscriber.sent, MSG_NOSIGNAL);
+      if (sent < 0) {
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return false;
+         }
+
+         // A subscriber that keeps up but always has some backlog would never get
+         // pending cleared, so drop the sent part once it's half of the buffer
+         if (subscriber.sent > subscriber.pending.size() / 2) {
+            subscriber.pending.erase(subscriber.pending.begin(), subscriber.pending.begin() + subscriber.sent);
+            subscriber.sent = 0;
+         }
+         return true;
+      }
+      subscriber.sent += sent;
+   }
+
+   subscriber.pending.clear();
+   subscriber.sent = 0;
+   return true;
+}
+
+void
+SubscriberServer::run()
+{
+   std::vector<struct pollfd> fds;
+
+   while (!mStopping) {
+      fds.clear();
+      fds.push_back({ mWakePipe[0], POLLIN, 0 });
+      fds.push_back({ mListenFd, POLLIN, 0 });
+
+      {
+         std::lock_guard<std::mutex> lock { mMutex };
+         for (auto &subscriber : mSubscribers) {
+            short events = POLLIN;
+            if (subscriber->sent < subscriber->pending.size()) {
+               events |= POLLOUT;
+            }
+            fds.push_back({ subscriber->fd, events, 0 });
+         }
+      }
+
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+         continue;
+      }
+
+      char drain[256];
+      while (read(mWakePipe[0], drain, sizeof(drain)) > 0) {
+      }
+
+      if (fds[1].revents & POLLIN) {
+         accept();
+      }
+
+      // Subscribers accepted above come after the ones polled, so indices still line up
+      std::lock_guard<std::mutex> lock { mMutex };
+      for (size_t i = 0; i < mSubscribers.size(); ++i) {
+         auto &subscriber = *mSubscribers[i];
+         auto revents = i + 2 < fds.size() ? fds[i + 2].revents : 0;
+         const char *reason = nullptr;
+
+         if (subscriber.tooSlow) {
+            reason = "disconnected, it fell too far behind";
+         } else if (revents & (POLLERR | POLLHUP)) {
+            reason = "disconnected";
+         } else if (revents & POLLIN) {
+            // Subscribers don't send anything, this is only to notice them leaving
+            auto received = recv(subscriber.fd, drain, sizeof(drain), 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+               reason = "disconnected";
+            }
+         }
+
+         if (!reason && !send(subscriber)) {
+            reason = "disconnected";
+         }
+
+         if (reason) {
+            fprintf(stderr, "udplogserver: %s %s\n", subscriber.name.c_str(), reason);
+            close(subscriber.fd);
+            subscriber.fd = -1;
+         }
+      }
+
+      mSubscribers.erase(std::remove_if(mSubscribers.begin(), mSubscribers.end(),
+                                        [](const std::unique_ptr<Subscriber> &subscriber) { return subscriber->fd < 0; }),
+                         mSubscribers.end());
+      mCount = mSubscribers.size();
+   }
+}
+#else
+void
+SubscriberServer::run()
+{
+}
+
+void
+SubscriberServer::accept()
+{
+}
+
+bool
+SubscriberServer::send(Subscriber &subscriber)
+{
+   return false;
+}
+#endif
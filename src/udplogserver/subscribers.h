@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Serves the log output to local subscribers over a Unix domain socket or
+ * TCP on localhost, from its own thread.
+ *
+ * Every subscriber gets a bounded buffer. A subscriber that falls further
+ * behind than that is disconnected, so it can't hold up the output.
+ */
+class SubscriberServer
+{
+public:
+   ~SubscriberServer();
+
+   // address is "unix:<path>" or "tcp:<port>", nullptr on failure
+   static SubscriberServer *
+   open(const std::string &address,
+        size_t bufferSize);
+
+   // Writer thread: queues whole lines for every subscriber.
+   void
+   publish(const char *data,
+           size_t size);
+
+private:
+   struct Subscriber
+   {
+      int fd;
+      std::string name;
+      std::vector<char> pending;
+      size_t sent = 0;
+      bool tooSlow = false;
+   };
+
+   SubscriberServer(int listenFd,
+                    const std::string &unixPath,
+                    size_t bufferSize);
+
+   void
+   run();
+
+   void
+   wake();
+
+   void
+   accept();
+
+   bool
+   send(Subscriber &subscriber);
+
+   int mListenFd;
+   std::string mUnixPath;
+   size_t mBufferSize;
+   int mWakePipe[2] = { -1, -1 };
+
+   std::thread mThread;
+   std::mutex mMutex;
+   std::vector<std::unique_ptr<Subscriber>> mSubscribers;
+   std::atomic<size_t> mCount { 0 };
+   std::atomic<bool> mStopping { false };
+   unsigned mNextId = 0;
+};
@@ -0,0 +1,254 @@
+#include "symbols.h"
+#include "elf.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <zlib.h>
+
+struct Section
+{
+   elf::SectionHeader header;
+   std::vector<char> data;
+};
+
+/**
+ * Reads a section's header and data, inflating deflated sections like readrpl does.
+ */
+static bool
+readSection(std::ifstream &fh,
+            Section &section)
+{
+   fh.read(reinterpret_cast<char *>(&section.header), sizeof(elf::SectionHeader));
+
+   if (section.header.type == elf::SHT_NOBITS || !section.header.size) {
+      return true;
+   }
+
+   if (section.header.flags & elf::SHF_DEFLATED) {
+      // Deflated sections start with their inflated size
+      uint32_t size = 0;
+      fh.seekg(section.header.offset.value());
+      fh.read(reinterpret_cast<char *>(&size), sizeof(uint32_t));
+      size = byte_swap(size);
+      section.data.resize(size);
+
+      std::vector<char> temp;
+      temp.resize(section.header.size - sizeof(uint32_t));
+      fh.read(temp.data(), temp.size());
+
+      auto stream = z_stream {};
+      if (inflateInit(&stream) != Z_OK) {
+         return false;
+      }
+
+      stream.avail_in = static_cast<uInt>(temp.size());
+      stream.next_in = reinterpret_cast<Bytef *>(temp.data());
+      stream.avail_out = static_cast<uInt>(section.data.size());
+      stream.next_out = reinterpret_cast<Bytef *>(section.data.data());
+
+      auto ret = inflate(&stream, Z_FINISH);
+      inflateEnd(&stream);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+         return false;
+      }
+   } else {
+      section.data.resize(section.header.size);
+      fh.seekg(section.header.offset.value());
+      fh.read(section.data.data(), section.header.size);
+   }
+
+   return !!fh;
+}
+
+bool
+SymbolTable::load(const std::string &path)
+{
+   std::ifstream fh { path, std::ifstream::binary };
+   if (!fh.is_open()) {
+      fprintf(stderr, "Could not open %s for reading\n", path.c_str());
+      return false;
+   }
+
+   elf::Header header;
+   fh.read(reinterpret_cast<char *>(&header), sizeof(elf::Header));
+   if (!fh || header.magic != elf::HeaderMagic) {
+      fprintf(stderr, "%s: invalid ELF magic header\n", path.c_str());
+      return false;
+   }
+
+   std::vector<Section> sections;
+   for (auto i = 0u; i < header.shnum; ++i) {
+      Section section;
+      fh.seekg(header.shoff + header.shentsize * i);
+      if (!readSection(fh, section)) {
+         fprintf(stderr, "%s: error reading section %u\n", path.c_str(), i);
+         return false;
+      }
+      sections.push_back(std::move(section));
+   }
+
+   // Text and data are the loaded sections, .bss included
+   for (auto i = 0u; i < sections.size(); ++i) {
+      auto &section = sections[i].header;
+      if ((section.flags & elf::SHF_ALLOC) && section.addr && section.size &&
+          (section.type == elf::SHT_PROGBITS || section.type == elf::SHT_NOBITS)) {
+         mRanges.push_back({ section.addr, section.addr + section.size, i });
+      }
+   }
+   std::sort(mRanges.begin(), mRanges.end(),
+             [](const Range &lhs, const Range &rhs) { return lhs.start < rhs.start; });
+
+   for (auto &symtab : sections) {
+      if (symtab.header.type != elf::SHT_SYMTAB || symtab.header.link >= sections.size()) {
+         continue;
+      }
+
+      auto &strtab = sections[symtab.header.link].data;
+      auto symbols = reinterpret_cast<const elf::Symbol *>(symtab.data.data());
+      auto count = symtab.data.size() / sizeof(elf::Symbol);
+
+      for (auto i = 0u; i < count; ++i) {
+         auto &symbol = symbols[i];
+         auto type = symbol.info & 0xf;
+         auto range = findRange(symbol.value);
+         if ((type != elf::STT_FUNC && type != elf::STT_OBJECT && type != elf::STT_NOTYPE) ||
+             symbol.shndx == elf::SHN_UNDEF || symbol.shndx >= elf::SHN_LORESERVE ||
+             !range || range->section != symbol.shndx ||
+             symbol.name >= strtab.size() || !strtab[symbol.name]) {
+            continue;
+         }
+
+         // Skip the local $a/$d style mapping labels
+         auto name = strtab.data() + symbol.name;
+         if (name[0] == '$') {
+            continue;
+         }
+
+         mSymbols.push_back({ symbol.value, symbol.size, symbol.shndx, static_cast<uint32_t>(mNames.size()) });
+         mNames.append(name, strnlen(name, strtab.size() - symbol.name));
+         mNames.push_back('\0');
+      }
+   }
+
+   std::sort(mSymbols.begin(), mSymbols.end(),
+             [](const Symbol &lhs, const Symbol &rhs) {
+                return lhs.address != rhs.address ? lhs.address < rhs.address : lhs.size > rhs.size;
+             });
+
+   // Keep one symbol per address
+   mSymbols.erase(std::unique(mSymbols.begin(), mSymbols.end(),
+                              [](const Symbol &lhs, const Symbol &rhs) { return lhs.address == rhs.address; }),
+                  mSymbols.end());
+   return true;
+}
+
+const SymbolTable::Range *
+SymbolTable::findRange(uint32_t address) const
+{
+   auto it = std::upper_bound(mRanges.begin(), mRanges.end(), address,
+                              [](uint32_t value, const Range &range) { return value < range.start; });
+   if (it == mRanges.begin()) {
+      return nullptr;
+   }
+
+   --it;
+   return address < it->end ? &*it : nullptr;
+}
+
+bool
+SymbolTable::lookup(uint32_t address,
+                    const char *&name,
+                    uint32_t &offset) const
+{
+   auto range = findRange(address);
+   if (!range) {
+      return false;
+   }
+
+   auto it = std::upper_bound(mSymbols.begin(), mSymbols.end(), address,
+                              [](uint32_t value, const Symbol &symbol) { return value < symbol.address; });
+   if (it == mSymbols.begin()) {
+      return false;
+   }
+
+   // A sized symbol has to contain the address, a label is taken as the
+   // nearest one before it within the same section
+   --it;
+   if (it->section != range->section || (it->size && address - it->address >= it->size)) {
+      return false;
+   }
+
+   name = mNames.data() + it->name;
+   offset = address - it->address;
+   return true;
+}
+
+static bool
+isWordChar(char c)
+{
+   return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool
+SymbolTable::annotate(const char *line,
+                      size_t size,
+                      std::string &out) const
+{
+   size_t copied = 0;
+   auto annotated = false;
+
+   for (size_t i = 0; i < size; ) {
+      if (!isxdigit(static_cast<unsigned char>(line[i])) || (i > 0 && isWordChar(line[i - 1]))) {
+         ++i;
+         continue;
+      }
+
+      // 0x followed by up to 8 digits, or a bare word of exactly 8 hex digits
+      auto prefixed = i + 2 < size && line[i] == '0' && (line[i + 1] == 'x' || line[i + 1] == 'X');
+      auto start = prefixed ? i + 2 : i;
+      auto end = start;
+      uint32_t address = 0;
+      while (end < size && end - start < 9 && isxdigit(static_cast<unsigned char>(line[end]))) {
+         auto c = static_cast<unsigned char>(line[end]);
+         address = (address << 4) | static_cast<uint32_t>(isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+         ++end;
+      }
+
+      auto digits = end - start;
+      auto valid = (end == size || !isWordChar(line[end])) && (prefixed ? digits >= 1 && digits <= 8 : digits == 8);
+
+      const char *name;
+      uint32_t offset;
+      if (valid && lookup(address, name, offset)) {
+         if (!annotated) {
+            out.clear();
+            annotated = true;
+         }
+
+         out.append(line + copied, end - copied);
+         out.append(" <");
+         out.append(name);
+         if (offset) {
+            char text[16];
+            snprintf(text, sizeof(text), "+0x%x", offset);
+            out.append(text);
+         }
+         out.push_back('>');
+         copied = end;
+      }
+
+      // Skip the rest of the word
+      i = end > i ? end : i + 1;
+      while (i < size && isWordChar(line[i])) {
+         ++i;
+      }
+   }
+
+   if (annotated) {
+      out.append(line + copied, size - copied);
+   }
+   return annotated;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Address to symbol index of an RPX/RPL, for annotating the code and data
+ * addresses in crash dumps.
+ */
+class SymbolTable
+{
+public:
+   // Reads the symbol tables, false with an error printed on failure
+   bool
+   load(const std::string &path);
+
+   // The symbol containing address, false if it isn't in a loaded section
+   bool
+   lookup(uint32_t address,
+          const char *&name,
+          uint32_t &offset) const;
+
+   // Copies line to out with " <symbol+offset>" after every hex address that
+   // resolves, false (and out untouched) if none does.
+   bool
+   annotate(const char *line,
+            size_t size,
+            std::string &out) const;
+
+   size_t
+   size() const
+   {
+      return mSymbols.size();
+   }
+
+private:
+   struct Range
+   {
+      uint32_t start;
+      uint32_t end;
+      uint32_t section;
+   };
+
+   struct Symbol
+   {
+      uint32_t address;
+      uint32_t size;
+      uint32_t section;
+      uint32_t name; // Offset into mNames
+   };
+
+   const Range *
+   findRange(uint32_t address) const;
+
+   // Text and data sections, sorted by address
+   std::vector<Range> mRanges;
+   // Sorted by address, sized symbols before labels at the same address
+   std::vector<Symbol> mSymbols;
+   std::string mNames;
+};
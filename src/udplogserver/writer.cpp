@@ -0,0 +1,487 @@
+#include "writer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+OutputWriter::OutputWriter(SourceTable &sources,
+                           const OutputOptions &options) :
+   mSources(sources),
+   mOptions(options)
+{
+   for (auto i = 0u; i < options.receivers; ++i) {
+      mReceivers.emplace_back(new Receiver { options.ringSize });
+   }
+
+   if (options.path.empty()) {
+      mOut.reset(new OutputFile { stdout });
+   } else {
+      mOut.reset(OutputFile::open(options.path, options.rotate, &mCompressor));
+      if (!mOut) {
+         fprintf(stderr, "udplogserver: could not open %s\n", options.path.c_str());
+         exit(EXIT_FAILURE);
+      }
+   }
+   mOut->setSubscribers(options.subscribers);
+
+   mThread = std::thread { [this]() { run(); } };
+}
+
+OutputWriter::~OutputWriter()
+{
+   stop();
+}
+
+void
+OutputWriter::write(unsigned receiver,
+                    Source *source,
+                    uint64_t timestamp,
+                    const char *data,
+                    size_t size)
+{
+   source->datagrams.fetch_add(1, std::memory_order_relaxed);
+   source->bytes.fetch_add(size, std::memory_order_relaxed);
+
+   if (!mReceivers[receiver]->ring.push(source->id, timestamp, data, size)) {
+      source->dropped.fetch_add(1, std::memory_order_relaxed);
+      mOverflows.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+uint64_t
+OutputWriter::kernelDrops() const
+{
+   uint64_t count = 0;
+   for (auto &receiver : mReceivers) {
+      count += receiver->kernelDrops.load(std::memory_order_relaxed);
+   }
+   return count;
+}
+
+bool
+OutputWriter::ringsEmpty() const
+{
+   for (auto &receiver : mReceivers) {
+      if (!receiver->ring.empty()) {
+         return false;
+      }
+   }
+   return true;
+}
+
+void
+OutputWriter::notify()
+{
+   // The ring push is a release store, without a full fence it could be ordered
+   // after this load and miss the writer going to sleep. Pairs with the fence in
+   // run() between setting mSleeping and checking ringsEmpty().
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (mSleeping.load()) {
+      std::lock_guard<std::mutex> lock { mMutex };
+      mWakeup.notify_one();
+   }
+}
+
+void
+OutputWriter::stop()
+{
+   if (!mThread.joinable()) {
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock { mMutex };
+      mStopping = true;
+      mWakeup.notify_one();
+   }
+   mThread.join();
+}
+
+static std::string
+replaceAll(std::string str,
+           const std::string &from,
+           const std::string &to)
+{
+   for (auto pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size())) {
+      str.replace(pos, from.size(), to);
+   }
+   return str;
+}
+
+OutputWriter::SourceOutput &
+OutputWriter::getSourceOutput(uint32_t id)
+{
+   if (id < mSourceOutputs.size() && mSourceOutputs[id]) {
+      return *mSourceOutputs[id];
+   }
+
+   if (id >= mSourceOutputs.size()) {
+      mSourceOutputs.resize(id + 1);
+   }
+
+   auto source = mSources.get(id);
+   auto output = new SourceOutput();
+   output->output = mOut.get();
+   mSourceOutputs[id].reset(output);
+
+   if (mOptions.prefix) {
+      output->prefix = "[" + source->name + "] ";
+   }
+
+   if (!mOptions.splitPattern.empty()) {
+      auto ip = source->name.substr(0, source->name.find(':'));
+      auto path = replaceAll(replaceAll(mOptions.splitPattern, "{ip}", ip), "{port}", std::to_string(source->port));
+      output->file.reset(OutputFile::open(path, mOptions.rotate, &mCompressor));
+      if (output->file) {
+         output->file->setSubscribers(mOptions.subscribers);
+         output->output = output->file.get();
+      } else {
+         fprintf(stderr, "udplogserver: could not open %s, writing %s to the main output\n", path.c_str(), source->name.c_str());
+      }
+   }
+
+   return *output;
+}
+
+static const char *
+findLastNewline(const char *data,
+                size_t size)
+{
+   for (auto pos = data + size; pos != data; --pos) {
+      if (pos[-1] == '\n') {
+         return pos - 1;
+      }
+   }
+   return nullptr;
+}
+
+/**
+ * Splits a datagram into lines. Complete lines are written straight from the
+ * ring record, only a trailing partial line is copied aside to wait for the
+ * datagram that finishes it.
+ */
+void
+OutputWriter::assemble(SourceOutput &source,
+                       uint64_t timestamp,
+                       const char *data,
+                       size_t size,
+                       clock::time_point now)
+{
+   if (!source.partial.empty()) {
+      auto newline = static_cast<const char *>(memchr(data, '\n', size));
+      auto length = newline ? static_cast<size_t>(newline - data + 1) : size;
+      source.partial.append(data, length);
+      data += length;
+      size -= length;
+
+      if (newline) {
+         writeLines(source, source.partialTimestamp, source.partial.data(), source.partial.size());
+         source.partial.clear();
+      } else if (source.partial.size() >= MaxLineSize) {
+         writePartial(source);
+      }
+   }
+
+   auto last = findLastNewline(data, size);
+   auto complete = last ? static_cast<size_t>(last - data + 1) : 0;
+   if (complete) {
+      writeLines(source, timestamp, data, complete);
+   }
+
+   if (complete < size) {
+      source.partial.assign(data + complete, size - complete);
+      source.partialSince = now;
+      source.partialTimestamp = timestamp;
+
+      if (source.partial.size() >= MaxLineSize) {
+         writePartial(source);
+      }
+   }
+}
+
+// data must end with a newline
+void
+OutputWriter::writeLines(SourceOutput &source,
+                         uint64_t timestamp,
+                         const char *data,
+                         size_t size)
+{
+   auto filtering = !mOptions.filter.empty() || !mOptions.exclude.empty();
+   if (source.prefix.empty() && !mOptions.timestamps && !filtering && !mOptions.symbols) {
+      source.output->append(data, size);
+      mPendingSize += size;
+      return;
+   }
+
+   while (size) {
+      auto newline = static_cast<const char *>(memchr(data, '\n', size));
+      auto length = static_cast<size_t>(newline - data + 1);
+      auto line = data;
+      data += length;
+      size -= length;
+
+      if (filtering && !isSelected(line, length - 1)) {
+         continue;
+      }
+
+      if (mOptions.symbols && mOptions.symbols->annotate(line, length, mAnnotated)) {
+         line = mAnnotated.data();
+         length = mAnnotated.size();
+      }
+
+      if (mOptions.timestamps) {
+         writeTimestamp(source.output, timestamp);
+      }
+      source.output->append(source.prefix.data(), source.prefix.size());
+      mPendingSize += source.prefix.size();
+
+      if (mOptions.highlight && !mOptions.filter.empty()) {
+         writeHighlighted(source.output, line, length);
+      } else {
+         source.output->append(line, length);
+         mPendingSize += length;
+      }
+   }
+}
+
+// Whether a line, without its newline, passes --filter and --exclude
+bool
+OutputWriter::isSelected(const char *line,
+                         size_t size)
+{
+   if (!mOptions.filter.empty() && !mOptions.filter.search(line, size)) {
+      return false;
+   }
+
+   return mOptions.exclude.empty() || !mOptions.exclude.search(line, size);
+}
+
+// Writes a line with every --filter match in bold red
+void
+OutputWriter::writeHighlighted(OutputFile *output,
+                               const char *line,
+                               size_t size)
+{
+   static const char HighlightStart[] = "\x1b[1;31m";
+   static const char HighlightEnd[] = "\x1b[0m";
+
+   auto text = size - 1;
+   size_t written = 0;
+   size_t length;
+   for (size_t pos = 0; pos < text; ) {
+      if (!mOptions.filter.matchAt(line, text, pos, length) || length == 0) {
+         ++pos;
+         continue;
+      }
+
+      output->append(line + written, pos - written);
+      output->append(HighlightStart, sizeof(HighlightStart) - 1);
+      output->append(line + pos, length);
+      output->append(HighlightEnd, sizeof(HighlightEnd) - 1);
+      mPendingSize += sizeof(HighlightStart) + sizeof(HighlightEnd) - 2;
+      pos += length;
+      written = pos;
+   }
+
+   output->append(line + written, size - written);
+   mPendingSize += size;
+}
+
+// Terminates and writes a partial line that isn't going to be completed in time
+void
+OutputWriter::writePartial(SourceOutput &source)
+{
+   source.partial.push_back('\n');
+   writeLines(source, source.partialTimestamp, source.partial.data(), source.partial.size());
+   source.partial.clear();
+}
+
+// Writes "YYYY-mm-dd HH:MM:SS.nnnnnnnnn " in local time
+void
+OutputWriter::writeTimestamp(OutputFile *output,
+                             uint64_t timestamp)
+{
+   auto second = timestamp / 1000000000;
+   if (second != mTimestampSecond) {
+      auto time = static_cast<time_t>(second);
+      mTimestampLength = strftime(mTimestampText, sizeof(mTimestampText), "%Y-%m-%d %H:%M:%S.", localtime(&time));
+      mTimestampSecond = second;
+   }
+
+   char text[sizeof(mTimestampText) + 10];
+   memcpy(text, mTimestampText, mTimestampLength);
+
+   auto nanoseconds = static_cast<uint32_t>(timestamp % 1000000000);
+   for (auto i = 8; i >= 0; --i) {
+      text[mTimestampLength + i] = '0' + nanoseconds % 10;
+      nanoseconds /= 10;
+   }
+   text[mTimestampLength + 9] = ' ';
+
+   output->append(text, mTimestampLength + 10);
+   mPendingSize += mTimestampLength + 10;
+}
+
+// Returns when the next partial line times out
+OutputWriter::clock::time_point
+OutputWriter::writeStalePartials(clock::time_point now)
+{
+   auto next = clock::time_point::max();
+   for (auto &source : mSourceOutputs) {
+      if (!source || source->partial.empty()) {
+         continue;
+      }
+
+      auto timeout = source->partialSince + mOptions.lineTimeout;
+      if (timeout <= now) {
+         writePartial(*source);
+      } else {
+         next = std::min(next, timeout);
+      }
+   }
+   return next;
+}
+
+void
+OutputWriter::flush()
+{
+   mOut->flush();
+   for (auto &source : mSourceOutputs) {
+      if (source && source->file) {
+         source->file->flush();
+      }
+   }
+   mPendingSize = 0;
+}
+
+void
+OutputWriter::printStats()
+{
+   for (auto source : mSources.all()) {
+      fprintf(stderr, "udplogserver: %s: %llu datagrams, %llu bytes, %llu dropped\n",
+              source->name.c_str(),
+              static_cast<unsigned long long>(source->datagrams.load(std::memory_order_relaxed)),
+              static_cast<unsigned long long>(source->bytes.load(std::memory_order_relaxed)),
+              static_cast<unsigned long long>(source->dropped.load(std::memory_order_relaxed)));
+   }
+}
+
+void
+OutputWriter::reportDrops(bool exiting)
+{
+   auto overflowCount = overflows();
+   if (overflowCount != mReportedOverflows) {
+      fprintf(stderr, exiting ? "udplogserver: %llu datagrams dropped because the output couldn't keep up\n"
+                              : "udplogserver: output can't keep up, %llu datagrams dropped so far\n",
+              static_cast<unsigned long long>(overflowCount));
+      mReportedOverflows = overflowCount;
+   }
+
+   auto kernelDropCount = kernelDrops();
+   if (kernelDropCount != mReportedKernelDrops) {
+      fprintf(stderr, exiting ? "udplogserver: %llu datagrams dropped by the kernel receive queue\n"
+                              : "udplogserver: receive queue overflowed, %llu datagrams dropped by the kernel so far\n",
+              static_cast<unsigned long long>(kernelDropCount));
+      mReportedKernelDrops = kernelDropCount;
+   }
+}
+
+void
+OutputWriter::run()
+{
+   auto pendingSince = clock::now();
+   auto lastStats = clock::now();
+
+   while (true) {
+      uint32_t id;
+      uint64_t timestamp;
+      size_t size;
+      auto received = clock::now();
+      // One bounded pass, so drop reports, statistics and partial lines are still
+      // handled while the rings never run empty because the output is too slow
+      auto drained = false;
+      for (auto &receiver : mReceivers) {
+         auto &ring = receiver->ring;
+         const char *data;
+         for (size_t i = 0; i < DrainBatchSize && (data = ring.front(id, timestamp, size)); ++i) {
+            if (mPendingSize == 0) {
+               pendingSince = received;
+            }
+
+            if (size) {
+               assemble(getSourceOutput(id), timestamp, data, size, received);
+            }
+            ring.pop();
+            drained = true;
+
+            if (mPendingSize >= CoalesceSize) {
+               flush();
+            }
+         }
+      }
+
+      auto now = clock::now();
+      auto partialTimeout = writeStalePartials(now);
+      if (mStopping || now - pendingSince >= mOptions.flushInterval) {
+         flush();
+      }
+
+      // Drops are reported at most once a second
+      if (now - mLastDropReport >= std::chrono::seconds { 1 }) {
+         reportDrops(false);
+         mLastDropReport = now;
+      }
+
+      auto statsInterval = mOptions.statsInterval;
+      if (statsInterval.count() && now - lastStats >= statsInterval) {
+         printStats();
+         lastStats = now;
+      }
+
+      if (mStopping && ringsEmpty()) {
+         break;
+      }
+
+      if (drained && !ringsEmpty()) {
+         continue;
+      }
+
+      // Sleep until new data arrives, or until pending output, partial lines or statistics are due
+      auto deadline = partialTimeout;
+      if (mPendingSize) {
+         deadline = std::min(deadline, pendingSince + mOptions.flushInterval);
+      }
+      if (statsInterval.count()) {
+         deadline = std::min(deadline, lastStats + statsInterval);
+      }
+      if (mOptions.rotate.interval.count()) {
+         // Idle segments still have to be rotated on time
+         deadline = std::min(deadline, now + std::chrono::seconds { 1 });
+      }
+
+      std::unique_lock<std::mutex> lock { mMutex };
+      mSleeping = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ringsEmpty() && !mStopping) {
+         if (deadline == clock::time_point::max()) {
+            mWakeup.wait(lock);
+         } else {
+            mWakeup.wait_until(lock, deadline);
+         }
+      }
+      mSleeping = false;
+   }
+
+   for (auto &source : mSourceOutputs) {
+      if (source && !source->partial.empty()) {
+         writePartial(*source);
+      }
+   }
+   flush();
+
+   reportDrops(true);
+
+   if (mOptions.printStats) {
+      printStats();
+   }
+}
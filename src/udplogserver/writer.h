@@ -0,0 +1,212 @@
+#pragma once
+#include "compressor.h"
+#include "matcher.h"
+#include "output.h"
+#include "ringbuffer.h"
+#include "sources.h"
+#include "symbols.h"
+#include "subscribers.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct OutputOptions
+{
+   // Number of receive threads, each gets its own ring
+   unsigned receivers = 1;
+   // Log file to write to instead of stdout
+   std::string path;
+   // Applies to the log file and the per-source files
+   RotateOptions rotate;
+   // Bytes of output queued per receive thread before datagrams are dropped
+   size_t ringSize = 8 * 1024 * 1024;
+   // How long output may be held back to batch writes
+   std::chrono::milliseconds flushInterval { 10 };
+   // How long a line may wait for the datagram that completes it
+   std::chrono::milliseconds lineTimeout { 100 };
+   // Start every line with the time its first datagram arrived
+   bool timestamps = false;
+   // Start every line with "[ip:port] "
+   bool prefix = false;
+   // Only lines matching filter and not matching exclude are written, empty matchers match all
+   Matcher filter;
+   Matcher exclude;
+   // Colour filter matches with ANSI escapes
+   bool highlight = false;
+   // Per-source output files, {ip} and {port} are replaced by the sender's address
+   std::string splitPattern;
+   // Annotate code and data addresses with their symbols, if set
+   const SymbolTable *symbols = nullptr;
+   // Also serve the output to these subscribers, if set
+   SubscriberServer *subscribers = nullptr;
+   // Print per-source statistics this often, 0 to only print them on exit
+   std::chrono::seconds statsInterval { 0 };
+   bool printStats = false;
+};
+
+/**
+ * Moves output off the receive threads: datagrams are queued in a ring buffer
+ * per receive thread and a writer thread coalesces them into large writes.
+ *
+ * A source is only ever received by one thread, so its datagrams stay in
+ * order within that thread's ring.
+ */
+class OutputWriter
+{
+public:
+   OutputWriter(SourceTable &sources,
+                const OutputOptions &options);
+   ~OutputWriter();
+
+   // Receive thread: queue a datagram, counted as an overflow when the ring is full.
+   // timestamp is its arrival time in nanoseconds since the epoch.
+   void
+   write(unsigned receiver,
+         Source *source,
+         uint64_t timestamp,
+         const char *data,
+         size_t size);
+
+   // Receive thread: wake the writer after a batch of write() calls.
+   void
+   notify();
+
+   // Flushes everything queued and stops the writer thread.
+   void
+   stop();
+
+   // Receive thread: the socket's running count of datagrams the kernel dropped.
+   void
+   setKernelDrops(unsigned receiver,
+                  uint64_t count)
+   {
+      mReceivers[receiver]->kernelDrops.store(count, std::memory_order_relaxed);
+   }
+
+   uint64_t
+   overflows() const
+   {
+      return mOverflows.load(std::memory_order_relaxed);
+   }
+
+   uint64_t
+   kernelDrops() const;
+
+private:
+   using clock = std::chrono::steady_clock;
+
+   static constexpr size_t CoalesceSize = 256 * 1024;
+   // Records taken from one ring before moving on to the next, so a busy
+   // receive thread can't starve the others
+   static constexpr size_t DrainBatchSize = 256;
+   // Partial lines longer than this are written out without waiting for their end
+   static constexpr size_t MaxLineSize = 64 * 1024;
+
+   struct Receiver
+   {
+      explicit Receiver(size_t ringSize) :
+         ring(ringSize)
+      {
+      }
+
+      RingBuffer ring;
+      std::atomic<uint64_t> kernelDrops { 0 };
+   };
+
+   // Writer thread state of a source
+   struct SourceOutput
+   {
+      OutputFile *output;
+      std::unique_ptr<OutputFile> file;
+      std::string prefix;
+
+      // Start of a line still waiting for its newline
+      std::string partial;
+      clock::time_point partialSince;
+      uint64_t partialTimestamp = 0;
+   };
+
+   void
+   run();
+
+   bool
+   ringsEmpty() const;
+
+   SourceOutput &
+   getSourceOutput(uint32_t id);
+
+   void
+   assemble(SourceOutput &source,
+            uint64_t timestamp,
+            const char *data,
+            size_t size,
+            clock::time_point now);
+
+   void
+   writeLines(SourceOutput &source,
+              uint64_t timestamp,
+              const char *data,
+              size_t size);
+
+   bool
+   isSelected(const char *line,
+              size_t size);
+
+   void
+   writeHighlighted(OutputFile *output,
+                    const char *line,
+                    size_t size);
+
+   void
+   writeTimestamp(OutputFile *output,
+                  uint64_t timestamp);
+
+   void
+   reportDrops(bool exiting);
+
+   void
+   writePartial(SourceOutput &source);
+
+   clock::time_point
+   writeStalePartials(clock::time_point now);
+
+   void
+   flush();
+
+   void
+   printStats();
+
+   // Declared first, so segments rotated during shutdown are still compressed
+   Compressor mCompressor;
+   std::unique_ptr<OutputFile> mOut;
+   SourceTable &mSources;
+   OutputOptions mOptions;
+   std::vector<std::unique_ptr<Receiver>> mReceivers;
+   std::vector<std::unique_ptr<SourceOutput>> mSourceOutputs;
+   size_t mPendingSize = 0;
+   // Scratch space for a line with its addresses annotated
+   std::string mAnnotated;
+
+   // Date and time of mTimestampSecond, only reformatted when the second changes
+   uint64_t mTimestampSecond = UINT64_MAX;
+   char mTimestampText[32];
+   size_t mTimestampLength = 0;
+
+   uint64_t mReportedOverflows = 0;
+   uint64_t mReportedKernelDrops = 0;
+   clock::time_point mLastDropReport;
+
+   std::thread mThread;
+   std::mutex mMutex;
+   std::condition_variable mWakeup;
+   std::atomic<bool> mSleeping { false };
+   std::atomic<bool> mStopping { false };
+   std::atomic<uint64_t> mOverflows { 0 };
+};
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <excmd.h>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Synthetic content trees for benchmarking wuhbtool
+
+struct SizeDistribution
+{
+   enum Type
+   {
+      Fixed,
+      Uniform,
+      LogNormal,
+   };
+
+   Type type = LogNormal;
+   uint64_t min = 0;
+   uint64_t max = 0;
+};
+
+static bool
+parseSize(const std::string &str, uint64_t &value)
+{
+   char *end = nullptr;
+   value = strtoull(str.c_str(), &end, 10);
+   if (end == str.c_str()) {
+      return false;
+   }
+
+   switch (*end) {
+   case 'k': case 'K': value <<= 10; end++; break;
+   case 'm': case 'M': value <<= 20; end++; break;
+   case 'g': case 'G': value <<= 30; end++; break;
+   }
+   return *end == '\0';
+}
+
+/**
+ * SIZE for a fixed size, MIN-MAX for a uniform distribution, log:MEDIAN for a
+ * log-normal distribution, which is closest to real game content.
+ */
+static bool
+parseSizeDistribution(const std::string &spec, SizeDistribution &dist)
+{
+   if (spec.compare(0, 4, "log:") == 0) {
+      dist.type = SizeDistribution::LogNormal;
+      return parseSize(spec.substr(4), dist.min);
+   }
+
+   auto dash = spec.find('-');
+   if (dash != std::string::npos) {
+      dist.type = SizeDistribution::Uniform;
+      return parseSize(spec.substr(0, dash), dist.min)
+          && parseSize(spec.substr(dash + 1), dist.max)
+          && dist.min <= dist.max;
+   }
+
+   dist.type = SizeDistribution::Fixed;
+   return parseSize(spec, dist.min);
+}
+
+static uint64_t
+pickSize(const SizeDistribution &dist, std::mt19937_64 &rng)
+{
+   switch (dist.type) {
+   case SizeDistribution::Fixed:
+      return dist.min;
+   case SizeDistribution::Uniform:
+      return std::uniform_int_distribution<uint64_t> { dist.min, dist.max }(rng);
+   case SizeDistribution::LogNormal:
+   default:
+      // Capped at 4096x the median so a single run can't produce a multi-GB outlier
+      auto size = std::lognormal_distribution<double> { std::log(static_cast<double>(dist.min)), 1.5 }(rng);
+      return static_cast<uint64_t>(std::min(size, dist.min * 4096.0));
+   }
+}
+
+static bool
+makeDirectory(const std::string &path)
+{
+#ifdef _WIN32
+   return _mkdir(path.c_str()) == 0;
+#else
+   return mkdir(path.c_str(), 0755) == 0;
+#endif
+}
+
+/**
+ * Writes size bytes of the content stream for id, equal ids give equal files.
+ */
+static bool
+writeFile(const std::string &path, uint64_t id, uint64_t size, std::vector<uint64_t> &buffer)
+{
+   FILE *out = fopen(path.c_str(), "wb");
+   if (!out) {
+      fprintf(stderr, "Could not open %s for writing\n", path.c_str());
+      return false;
+   }
+
+   std::mt19937_64 rng { id };
+   while (size) {
+      auto chunk = std::min<uint64_t>(size, buffer.size() * sizeof(uint64_t));
+      for (auto i = 0u; i < (chunk + 7) / 8; ++i) {
+         buffer[i] = rng();
+      }
+
+      if (fwrite(buffer.data(), 1, chunk, out) != chunk) {
+         fprintf(stderr, "Failed to write %s\n", path.c_str());
+         fclose(out);
+         return false;
+      }
+      size -= chunk;
+   }
+
+   return fclose(out) == 0;
+}
+
+int main(int argc, char **argv)
+{
+   excmd::parser parser;
+   excmd::option_state options;
+   using excmd::description;
+   using excmd::value;
+
+   try {
+      parser.global_options()
+         .add_option("H,help",
+                     description { "Show help." })
+         .add_option("files",
+                     description { "Number of files (default 10000)" },
+                     value<std::string> {})
+         .add_option("size",
+                     description { "File sizes: SIZE, MIN-MAX (uniform) or log:MEDIAN (default log:16K), with optional K/M/G suffixes" },
+                     value<std::string> {})
+         .add_option("depth",
+                     description { "Directory levels below the root (default 3)" },
+                     value<std::string> {})
+         .add_option("fanout",
+                     description { "Subdirectories per directory (default 8)" },
+                     value<std::string> {})
+         .add_option("duplicates",
+                     description { "Fraction of files that repeat the content of an earlier file (default 0)" },
+                     value<std::string> {})
+         .add_option("seed",
+                     description { "Random seed, the same arguments and seed always give the same tree (default 1)" },
+                     value<std::string> {});
+
+      parser.default_command()
+         .add_argument("dst",
+                       description { "Directory to create the tree in, must not exist yet" },
+                       value<std::string> {});
+
+      options = parser.parse(argc, argv);
+   } catch (excmd::exception &ex) {
+      fprintf(stderr, "Error parsing options: %s\n", ex.what());
+      return -1;
+   }
+
+   if (options.empty()
+       || options.has("help")
+       || !options.has("dst")) {
+      printf("%s <options> dst\n", argv[0]);
+      printf("%s\n", parser.format_help(argv[0]).c_str());
+      return 0;
+   }
+
+   auto numFiles = options.has("files") ? strtoull(options.get<std::string>("files").c_str(), nullptr, 10) : 10000ull;
+   auto depth = options.has("depth") ? strtoul(options.get<std::string>("depth").c_str(), nullptr, 10) : 3ul;
+   auto fanout = options.has("fanout") ? strtoul(options.get<std::string>("fanout").c_str(), nullptr, 10) : 8ul;
+   auto duplicates = options.has("duplicates") ? strtod(options.get<std::string>("duplicates").c_str(), nullptr) : 0.0;
+   auto seed = options.has("seed") ? strtoull(options.get<std::string>("seed").c_str(), nullptr, 10) : 1ull;
+
+   SizeDistribution sizes;
+   sizes.min = 16 * 1024;
+   if (options.has("size") && !parseSizeDistribution(options.get<std::string>("size"), sizes)) {
+      fprintf(stderr, "Invalid size distribution %s\n", options.get<std::string>("size").c_str());
+      return -1;
+   }
+
+   if (fanout == 0 || duplicates < 0.0 || duplicates >= 1.0) {
+      fprintf(stderr, "Expected a fanout of at least 1 and a duplicate ratio in [0, 1)\n");
+      return -1;
+   }
+
+   // Complete fanout-ary tree of directories, files are spread over all of them
+   auto dst = options.get<std::string>("dst");
+   std::vector<std::string> dirs { dst };
+   if (!makeDirectory(dst)) {
+      fprintf(stderr, "Could not create directory %s\n", dst.c_str());
+      return -1;
+   }
+
+   for (size_t level = 0, first = 0; level < depth; ++level) {
+      auto last = dirs.size();
+      for (auto i = first; i < last; ++i) {
+         for (auto j = 0ul; j < fanout; ++j) {
+            auto path = dirs[i] + "/d" + std::to_string(j);
+            if (!makeDirectory(path)) {
+               fprintf(stderr, "Could not create directory %s\n", path.c_str());
+               return -1;
+            }
+            dirs.push_back(path);
+         }
+      }
+      first = last;
+   }
+
+   std::mt19937_64 rng { seed };
+   std::uniform_real_distribution<double> chance { 0.0, 1.0 };
+   std::vector<std::pair<uint64_t, uint64_t>> contents; // id, size of every unique file
+   std::vector<uint64_t> buffer(64 * 1024 / sizeof(uint64_t));
+   uint64_t totalSize = 0;
+
+   for (auto i = 0ull; i < numFiles; ++i) {
+      uint64_t id, size;
+      if (!contents.empty() && chance(rng) < duplicates) {
+         std::tie(id, size) = contents[std::uniform_int_distribution<size_t> { 0, contents.size() - 1 }(rng)];
+      } else {
+         id = rng();
+         size = pickSize(sizes, rng);
+         contents.emplace_back(id, size);
+      }
+
+      auto path = dirs[i % dirs.size()] + "/f" + std::to_string(i) + ".bin";
+      if (!writeFile(path, id, size, buffer)) {
+         return -1;
+      }
+      totalSize += size;
+   }
+
+   printf("Generated %llu files (%llu unique) in %llu directories, %.1f MiB\n",
+          static_cast<unsigned long long>(numFiles),
+          static_cast<unsigned long long>(contents.size()),
+          static_cast<unsigned long long>(dirs.size()),
+          totalSize / (1024.0 * 1024.0));
+   return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Packaging benchmark for wuhbtool, run through `make benchmark`.
+#
+# Environment:
+#   BENCH_FILES       file counts to benchmark (default "10000 100000 1000000")
+#   BENCH_SIZE        gentree --size distribution (default log:16K)
+#   BENCH_DEPTH       gentree --depth (default 3)
+#   BENCH_FANOUT      gentree --fanout (default 8)
+#   BENCH_DUPLICATES  gentree --duplicates (default 0)
+#   BENCH_DIR         scratch directory, needs room for each tree and its archive (default ./wuhbbench.tmp)
+#   BENCH_ARGS        extra wuhbtool arguments, e.g. "--checksums /dev/null"
+#   WUHBTOOL, GENTREE paths of the binaries (default ./wuhbtool and ./wuhbbench-gentree)
+
+set -e
+
+WUHBTOOL=${WUHBTOOL:-./wuhbtool}
+GENTREE=${GENTREE:-./wuhbbench-gentree}
+BENCH_FILES=${BENCH_FILES:-"10000 100000 1000000"}
+BENCH_SIZE=${BENCH_SIZE:-log:16K}
+BENCH_DEPTH=${BENCH_DEPTH:-3}
+BENCH_FANOUT=${BENCH_FANOUT:-8}
+BENCH_DUPLICATES=${BENCH_DUPLICATES:-0}
+BENCH_DIR=${BENCH_DIR:-./wuhbbench.tmp}
+
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+
+# Any small file will do as root.rpx, the benchmark is about the content
+head -c 65536 /dev/zero > "$BENCH_DIR/root.rpx"
+
+for files in $BENCH_FILES; do
+   echo "== $files files, size $BENCH_SIZE, depth $BENCH_DEPTH, fanout $BENCH_FANOUT, duplicates $BENCH_DUPLICATES"
+   "$GENTREE" --files "$files" --size "$BENCH_SIZE" --depth "$BENCH_DEPTH" \
+      --fanout "$BENCH_FANOUT" --duplicates "$BENCH_DUPLICATES" "$BENCH_DIR/content"
+
+   "$WUHBTOOL" "$BENCH_DIR/root.rpx" "$BENCH_DIR/bench.wuhb" --content "$BENCH_DIR/content" \
+      --timings $BENCH_ARGS | grep '^Timing:'
+
+   rm -rf "$BENCH_DIR/content" "$BENCH_DIR/bench.wuhb"
+done
+
+rm -rf "$BENCH_DIR"
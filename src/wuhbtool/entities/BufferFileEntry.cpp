@@ -13,4 +13,8 @@ void BufferFileEntry::write(FILE *f_out, off_t base_offset) {
         fprintf(stderr, "Failed to write to output!\n");
         exit(EXIT_FAILURE);
     }
+
+    if (this->checksum) {
+        this->checksum->update(this->buffer.data(), this->size);
+    }
 }
@@ -1,5 +1,6 @@
 #include "DirectoryEntry.h"
 #include <cstring>
+#include <algorithm>
 #include "../utils/utils.h"
 #include "../services/RomFSService.h"
 
@@ -12,6 +13,15 @@ bool DirectoryEntry::addChild(NodeEntry *file) {
     return false;
 }
 
+bool DirectoryEntry::removeChild(NodeEntry *child) {
+    auto it = std::find(children.begin(), children.end(), child);
+    if (it == children.end()) {
+        return false;
+    }
+    children.erase(it);
+    return true;
+}
+
 void DirectoryEntry::calculateDirOffsets(romfs_ctx_t *romfs_ctx, uint32_t *entry_offset) {
     if (!this->entry_offset_set) {
         this->updateEntryOffset(entry_offset);
@@ -39,6 +49,19 @@ void DirectoryEntry::calculateFileOffsets(romfs_ctx_t *romfs_ctx, uint32_t *entr
     }
 }
 
+void DirectoryEntry::collectFiles(std::vector<FileEntry *> &files) {
+    for (auto const &e : children) {
+        if (e->isDirNode()) {
+            static_cast<DirectoryEntry *>(e)->collectFiles(files);
+        }
+    }
+    for (auto const &e : children) {
+        if (e->isFileNode()) {
+            files.push_back(static_cast<FileEntry *>(e));
+        }
+    }
+}
+
 void DirectoryEntry::updateEntryOffset(uint32_t *entry_offset) {
     if (entry_offset) {
         this->entry_offset = *entry_offset;
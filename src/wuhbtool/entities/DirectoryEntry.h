@@ -25,6 +25,9 @@ public:
 
     bool addChild(NodeEntry *file);
 
+    /* Detaches child without deleting it. */
+    bool removeChild(NodeEntry *child);
+
     void printRecursive(int indentation) override {
         NodeEntry::printRecursive(indentation);
 
@@ -37,6 +40,8 @@ public:
 
     virtual void calculateDirOffsets(romfs_ctx_t *ptr, uint32_t *entry_offset);
 
+    void collectFiles(std::vector<FileEntry *> &files);
+
     void populate(romfs_infos_t *romfs_infos) override;
 
     virtual void updateSiblingAndChildEntries();
@@ -2,6 +2,7 @@
 
 #include "NodeEntry.h"
 #include "../services/RomFSStructs.h"
+#include "../utils/hashpool.h"
 
 class FileEntry : public NodeEntry {
 public:
@@ -17,4 +18,7 @@ public:
     FileEntry *sibling = nullptr;
     uint64_t size = 0;
 
+    /* When set, write() hands the data it streams to this stream of the hash pool. */
+    HashStream *checksum = nullptr;
+
 };
@@ -15,11 +15,14 @@ void OSFileEntry::write(FILE *f_out, off_t base_offset) {
         exit(EXIT_FAILURE);
     }
 
-    /* Write files. */
-    auto *buffer = static_cast<unsigned char *>(malloc(0x400000));
-    if (buffer == nullptr) {
-        fprintf(stderr, "Failed to allocate work buffer!\n");
-        exit(EXIT_FAILURE);
+    /* Write files. With a checksum, chunks are read into hash pool buffers and hashed by its workers while the copy goes on. */
+    unsigned char *own_buffer = nullptr;
+    if (!this->checksum) {
+        own_buffer = static_cast<unsigned char *>(malloc(HashPool::BufferSize));
+        if (own_buffer == nullptr) {
+            fprintf(stderr, "Failed to allocate work buffer!\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if(fseeko64(f_out, base_offset + this->offset + ROMFS_FILEPARTITION_OFS, SEEK_SET) != 0){
@@ -27,12 +30,13 @@ void OSFileEntry::write(FILE *f_out, off_t base_offset) {
         exit(EXIT_FAILURE);
     }
     uint64_t offset = 0;
-    uint64_t read_size = 0x400000;
+    uint64_t read_size = HashPool::BufferSize;
     while (offset < this->size) {
         if (this->size - offset < read_size) {
             read_size = this->size - offset;
         }
 
+        auto *buffer = this->checksum ? this->checksum->buffer() : own_buffer;
         if (fread(buffer, 1, read_size, f_in) != read_size) {
             fprintf(stderr, "Failed to read from %s!\n", this->osPath.char_path);
             exit(EXIT_FAILURE);
@@ -43,11 +47,14 @@ void OSFileEntry::write(FILE *f_out, off_t base_offset) {
             exit(EXIT_FAILURE);
         }
 
+        if (this->checksum) {
+            this->checksum->commit(read_size);
+        }
         offset += read_size;
     }
 
     os_fclose(f_in);
-    free(buffer);
+    free(own_buffer);
 }
 
 FileEntry *OSFileEntry::fromPath(const char* inputPath, const char* filename) {
@@ -12,6 +12,10 @@ public:
 
     static FileEntry* fromPath(const char* inputPath, const char* filename);
 
+    const filepath_t &getOSPath() const {
+        return osPath;
+    }
+
 private:
     filepath_t osPath;
 };
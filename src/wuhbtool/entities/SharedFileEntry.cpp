@@ -0,0 +1,13 @@
+#include <stdlib.h>
+#include "SharedFileEntry.h"
+
+void SharedFileEntry::write(FILE *f_out, off_t base_offset) {
+    printf("Writing %s...\n", getFullPath().c_str());
+
+    if(fseeko64(f_out, base_offset + this->offset + ROMFS_FILEPARTITION_OFS, SEEK_SET) != 0){
+        fprintf(stderr, "Failed to seek!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    reader->write(consumer, index, f_out, this->checksum);
+}
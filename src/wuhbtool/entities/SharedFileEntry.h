@@ -0,0 +1,26 @@
+#pragma once
+
+#include "FileEntry.h"
+#include "../services/SharedContentReader.h"
+
+/* A file whose data comes from a SharedContentReader that also feeds other archives. */
+class SharedFileEntry final : public FileEntry {
+public:
+    SharedFileEntry(std::string &&name, uint64_t size, romfs::SharedContentReader *reader, size_t consumer, size_t index) : FileEntry(std::move(name)) {
+        this->size = size;
+        this->reader = reader;
+        this->consumer = consumer;
+        this->index = index;
+    }
+
+    void write(FILE *f_out, off_t base_offset) override;
+
+    size_t getIndex() const {
+        return index;
+    }
+
+private:
+    romfs::SharedContentReader *reader;
+    size_t consumer;
+    size_t index;
+};
@@ -1,5 +1,6 @@
 #include <cstring>
 #include <algorithm>
+#include <future>
 #include <excmd.h>
 
 #include "entities/RootEntry.h"
@@ -8,28 +9,31 @@
 
 #include "services/RomFSService.h"
 #include "services/TgaGzService.h"
+#include "services/VerifyService.h"
+#include "services/BuildService.h"
+
+#include "utils/timing.h"
 
 static void deinitializeFreeImage() {
    FreeImage_DeInitialise();
 }
 
-static inline void addFolderIfNotEmpty(DirectoryEntry *parent, DirectoryEntry *child) {
-   if (!child->getChildren().empty()) {
-      parent->addChild(child);
-   } else {
-      delete child;
+static romfs::ScanFilter parseScanFilter(excmd::option_state &options) {
+   romfs::ScanFilter filter;
+   if (options.has("exclude")) {
+      addGlobPatterns(filter.exclude, options.get<std::string>("exclude"));
    }
+   if (options.has("include")) {
+      addGlobPatterns(filter.include, options.get<std::string>("include"));
+   }
+   return filter;
 }
 
-static void addImageResource(DirectoryEntry *parent, const char* name, int width, int height, int bpp, excmd::option_state &options, const char *optName) {
+static std::future<FileEntry *> convertImageResource(const char* name, int width, int height, int bpp, const TgaGzOptions &tgaGzOptions, excmd::option_state &options, const char *optName) {
    if (!options.has(optName))
-      return;
+      return {};
 
-   std::string path = options.get<std::string>(optName);
-   FileEntry *file = createTgaGzFileEntry(path.c_str(), width, height, bpp, name);
-   if (file) {
-      parent->addChild(file);
-   }
+   return convertImageAsync(options.get<std::string>(optName), name, width, height, bpp, tgaGzOptions);
 }
 
 int main(int argc, char **argv) {
@@ -42,6 +46,9 @@ int main(int argc, char **argv) {
       parser.global_options()
             .add_option("H,help",
                      description{"Show help."})
+            .add_option("elf",
+                     description{"Convert this ELF file to root.rpx in memory instead of reading <rpx-file>, the output then is the only argument"},
+                     value<std::string>{})
             .add_option("content",
                      description{"Path to the /content directory"},
                      value<std::string>{})
@@ -62,7 +69,35 @@ int main(int argc, char **argv) {
                      value<std::string>{})
             .add_option("drc-image",
                description{"Splash Screen image shown on the DRC (854x480)"},
-               value<std::string>{});
+               value<std::string>{})
+            .add_option("image-compression",
+                     description{"Compression of the meta images: [zlib:]0-9 (default zlib:9) or libdeflate:1-12"},
+                     value<std::string>{})
+            .add_option("image-cache",
+                     description{"Directory used to cache converted icon and splash screen images between builds"},
+                     value<std::string>{})
+            .add_option("exclude",
+                     description{"Comma separated globs of content paths to leave out (e.g. .git,*.swp,src/), excluded directories are not scanned"},
+                     value<std::string>{})
+            .add_option("include",
+                     description{"Comma separated globs, only content files matching one of them are added"},
+                     value<std::string>{})
+            .add_option("order-file",
+                     description{"Text file listing archive paths (e.g. /content/foo.bin) in the order the title reads them, their data is laid out first"},
+                     value<std::string>{})
+            .add_option("hash-load-factor",
+                     description{"Average number of entries per dir/file hash bucket (default 1.0), lower values speed up lookups on the console"},
+                     value<std::string>{})
+            .add_option("hash-stats",
+                     description{"Print chain statistics of the dir/file hash tables"})
+            .add_option("timings",
+                     description{"Print the time spent in each phase, files/s, MB/s and peak memory use"})
+            .add_option("checksums",
+                     description{"Write a JSON manifest with a checksum of every file in the archive"},
+                     value<std::string>{})
+            .add_option("checksum-type",
+                     description{"Checksum used for --checksums: crc32c, xxh3 or sha256 (default)"},
+                     value<std::string>{});
 
       parser.default_command()
             .add_argument("rpx-file",
@@ -72,6 +107,16 @@ int main(int argc, char **argv) {
                        description{"Path to WUHB file"},
                        value<std::string>{});
 
+      parser.add_command("build")
+            .add_argument("build-spec",
+                       description{"Build every [archive] of this spec at once, scanning and reading shared content only once"},
+                       value<std::string>{});
+
+      parser.add_command("verify")
+            .add_argument("wuhb-file",
+                       description{"Path to WUHB file to check, use --content to also compare against the content source tree"},
+                       value<std::string>{});
+
       options = parser.parse(argc, argv);
    } catch (excmd::exception &ex) {
       fprintf(stderr, "Error parsing options: %s\n", ex.what());
@@ -79,85 +124,105 @@ int main(int argc, char **argv) {
    }
 
    if (options.empty() || options.has("help")) {
-      printf("%s <rpx-file> <output> [options]\n\n", argv[0]);
+      printf("%s <rpx-file> <output> [options]\n", argv[0]);
+      printf("%s --elf <elf-file> <output> [options]\n", argv[0]);
+      printf("%s build <build-spec> [options]\n", argv[0]);
+      printf("%s verify <wuhb-file> [--content <dir> [--include <globs>] [--exclude <globs>]]\n\n", argv[0]);
       printf("%s\n", parser.format_help(argv[0]).c_str());
       return EXIT_SUCCESS;
    }
 
+   if (options.has("verify")) {
+      std::string wuhbPath = options.get<std::string>("wuhb-file");
+      std::string contentPath = options.has("content") ? options.get<std::string>("content") : "";
+      // The source tree has to be filtered like it was for the build
+      romfs::ScanFilter filter = parseScanFilter(options);
+      return romfs::VerifyArchive(wuhbPath.c_str(), contentPath.empty() ? nullptr : contentPath.c_str(), filter) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
    // Set up FreeImage
    FreeImage_Initialise();
    atexit(deinitializeFreeImage);
 
-   auto root = new RootEntry();
+   TgaGzOptions tgaGzOptions;
+   if (options.has("image-cache")) {
+      tgaGzOptions.cacheDir = options.get<std::string>("image-cache");
+   }
 
-   auto codeFolder = new DirectoryEntry("code");
-   auto metaFolder = new DirectoryEntry("meta");
+   if (options.has("image-compression") && !parseImageCompression(options.get<std::string>("image-compression"), tgaGzOptions)) {
+      return EXIT_FAILURE;
+   }
 
-   std::string rpxFilePath = options.get<std::string>("rpx-file");
-   auto rpxFile = OSFileEntry::fromPath(rpxFilePath.c_str(), "root.rpx");
-   codeFolder->addChild(rpxFile);
-
-   {
-      std::string long_name = options.has("name") ? options.get<std::string>("name") : (
-         options.has("short-name") ? options.get<std::string>("short-name") : ""
-      );
-      std::string short_name = options.has("short-name") ? options.get<std::string>("short-name") : (
-         options.has("name") ? options.get<std::string>("name") : ""
-      );
-      std::string author = options.has("author") ? options.get<std::string>("author") : "Built with devkitPPC & wut";
-
-      if (long_name.empty() || short_name.empty()) {
-         size_t startpos = 0, endpos = rpxFilePath.length();
-
-#ifndef _WIN32
-         size_t slash = rpxFilePath.find_last_of('/');
-#else
-         size_t slash = rpxFilePath.find_last_of("/\\");
-#endif
-
-         if (slash != std::string::npos) {
-            startpos = slash+1;
-         }
-
-         size_t dot = rpxFilePath.find_last_of('.');
-         if (dot != std::string::npos) {
-            endpos = dot;
-         }
-
-         long_name = short_name = rpxFilePath.substr(startpos, endpos-startpos);
-      }
+   romfs::ArchiveOptions archiveOptions;
+   if (options.has("order-file")) {
+      std::string orderFilePath = options.get<std::string>("order-file");
+      archiveOptions.fileOrder = romfs::ReadFileOrder(orderFilePath.c_str());
+   }
 
-#define MAKE_META_INI(_buf,_size) snprintf((_buf),(_size), \
-         "[menu]\n" \
-         "longname=%s\n" \
-         "shortname=%s\n" \
-         "author=%s\n", \
-         long_name.c_str(), \
-         short_name.c_str(), \
-         author.c_str())
+   if (options.has("hash-load-factor")) {
+      std::string loadFactor = options.get<std::string>("hash-load-factor");
+      char *end = nullptr;
+      archiveOptions.hashLoadFactor = strtod(loadFactor.c_str(), &end);
+      if (end == loadFactor.c_str() || *end != '\0' || !(archiveOptions.hashLoadFactor >= 0.05 && archiveOptions.hashLoadFactor <= 16.0)) {
+         fprintf(stderr, "Invalid hash load factor %s, expected a value between 0.05 and 16\n", loadFactor.c_str());
+         return EXIT_FAILURE;
+      }
+   }
+   archiveOptions.printHashStats = options.has("hash-stats");
+   archiveOptions.printTimings = options.has("timings");
 
-      std::vector<uint8_t> metaIniData;
-      metaIniData.reserve(MAKE_META_INI(NULL, 0)+1);
-      metaIniData.resize(metaIniData.capacity()-1);
-      MAKE_META_INI(reinterpret_cast<char*>(metaIniData.data()), metaIniData.capacity());
+   if (options.has("checksums")) {
+      archiveOptions.checksumsPath = options.get<std::string>("checksums");
+   }
 
-#undef MAKE_META_INI
+   if (options.has("checksum-type") && !checksum_parse_type(options.get<std::string>("checksum-type"), &archiveOptions.checksumType)) {
+      return EXIT_FAILURE;
+   }
 
-      FileEntry * metaIni = new BufferFileEntry("meta.ini", std::move(metaIniData));
-      if(!metaIni){
+   if (options.has("build")) {
+      if (options.has("checksums")) {
+         fprintf(stderr, "Use checksums= in the build spec to write a manifest per archive\n");
          return EXIT_FAILURE;
       }
+      std::string specPath = options.get<std::string>("build-spec");
+      buildArchives(readBuildSpec(specPath.c_str()), tgaGzOptions, archiveOptions);
+      return EXIT_SUCCESS;
+   }
 
-      metaFolder->addChild(metaIni);
+   // With --elf the only positional argument is the output
+   std::string rpxFilePath, outputPath;
+   if (options.has("elf")) {
+      if (options.has("output")) {
+         fprintf(stderr, "--elf replaces <rpx-file>, only pass the output path\n");
+         return EXIT_FAILURE;
+      }
+      rpxFilePath = options.get<std::string>("elf");
+      outputPath = options.get<std::string>("rpx-file");
+   } else {
+      rpxFilePath = options.get<std::string>("rpx-file");
+      outputPath = options.get<std::string>("output");
    }
 
-   addImageResource(metaFolder, "iconTex.tga.gz",     128, 128, 32, options, "icon");
-   addImageResource(metaFolder, "bootTvTex.tga.gz",  1280, 720, 24, options, "tv-image");
-   addImageResource(metaFolder, "bootDrcTex.tga.gz",  854, 480, 24, options, "drc-image");
+   auto rpxConversion = options.has("elf") ? convertElfAsync(rpxFilePath) : std::future<FileEntry *>();
 
-   addFolderIfNotEmpty(root, codeFolder);
-   addFolderIfNotEmpty(root, metaFolder);
+   auto iconTex    = convertImageResource("iconTex.tga.gz",     128, 128, 32, tgaGzOptions, options, "icon");
+   auto bootTvTex  = convertImageResource("bootTvTex.tga.gz",  1280, 720, 24, tgaGzOptions, options, "tv-image");
+   auto bootDrcTex = convertImageResource("bootDrcTex.tga.gz",  854, 480, 24, tgaGzOptions, options, "drc-image");
+
+   auto root = new RootEntry();
+
+   auto codeFolder = new DirectoryEntry("code");
+   auto metaFolder = new DirectoryEntry("meta");
+
+   metaFolder->addChild(createMetaIniFileEntry(options.has("name") ? options.get<std::string>("name") : "",
+                                               options.has("short-name") ? options.get<std::string>("short-name") : "",
+                                               options.has("author") ? options.get<std::string>("author") : "Built with devkitPPC & wut",
+                                               rpxFilePath));
 
+   DirectoryEntry *contentFolder = nullptr;
+   romfs::PipelinedFolderScan *contentScan = nullptr;
+   /* Started before the content scan, so CreateArchive's totals and throughput include it. */
+   PhaseTimer timer(options.has("timings"));
    if (options.has("content")) {
       std::string contentPath = options.get<std::string>("content");
 
@@ -165,13 +230,42 @@ int main(int argc, char **argv) {
       filepath_init(&dirpath);
       filepath_set(&dirpath, contentPath.c_str());
 
-      auto contentFolder = romfs::CreateFolderFromPath(dirpath, "content");
+      romfs::ScanFilter filter = parseScanFilter(options);
+
+      // The content data is written while it's being scanned, unless an order file needs the whole tree first
+      if (options.has("order-file")) {
+         contentFolder = romfs::CreateFolderFromPath(dirpath, "content", filter);
+         timer.lap("scan");
+      } else {
+         contentScan = new romfs::PipelinedFolderScan(dirpath, "content", filter);
+      }
+   }
+
+   // Collected only once the content scan is running, so the ELF conversion overlaps it like the images do
+   if (rpxConversion.valid()) {
+      FileEntry *rpxFile = rpxConversion.get();
+      if (!rpxFile) {
+         return EXIT_FAILURE;
+      }
+      codeFolder->addChild(rpxFile);
+   } else {
+      auto rpxFile = OSFileEntry::fromPath(rpxFilePath.c_str(), "root.rpx");
+      codeFolder->addChild(rpxFile);
+   }
+
+   addConvertedFile(metaFolder, std::move(iconTex));
+   addConvertedFile(metaFolder, std::move(bootTvTex));
+   addConvertedFile(metaFolder, std::move(bootDrcTex));
+
+   addFolderIfNotEmpty(root, codeFolder);
+   addFolderIfNotEmpty(root, metaFolder);
+   if (contentFolder) {
       addFolderIfNotEmpty(root, contentFolder);
    }
 
-   std::string outputPath = options.get<std::string>("output");
-   romfs::CreateArchive(root, outputPath.c_str());
+   romfs::CreateArchive(root, outputPath.c_str(), archiveOptions, contentScan, &timer);
 
+   delete contentScan;
    delete root;
 
    return EXIT_SUCCESS;
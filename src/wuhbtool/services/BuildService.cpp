@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "BuildService.h"
+#include "SharedContentReader.h"
+#include "../entities/RootEntry.h"
+#include "../entities/OSFileEntry.h"
+#include "../entities/BufferFileEntry.h"
+#include "../entities/SharedFileEntry.h"
+#include "../../elf2rpl/elf2rpl.h"
+
+namespace {
+
+   std::string Trim(const std::string &str) {
+      size_t start = str.find_first_not_of(" \t\r\n");
+      if (start == std::string::npos) {
+         return "";
+      }
+      return str.substr(start, str.find_last_not_of(" \t\r\n") - start + 1);
+   }
+
+   bool IsAbsolutePath(const std::string &path) {
+#ifdef _WIN32
+      if (path.size() > 1 && path[1] == ':') {
+         return true;
+      }
+      if (!path.empty() && path[0] == '\\') {
+         return true;
+      }
+#endif
+      return !path.empty() && path[0] == '/';
+   }
+
+   bool SetSpecValue(ArchiveSpec &spec, const std::string &key, const std::string &value, const std::string &baseDir) {
+      std::string path = value.empty() || IsAbsolutePath(value) ? value : baseDir + value;
+
+      if (key == "output") {
+         spec.output = path;
+      } else if (key == "rpx") {
+         spec.rpx = path;
+      } else if (key == "elf") {
+         spec.elf = path;
+      } else if (key == "content") {
+         spec.content = path;
+      } else if (key == "exclude") {
+         spec.exclude = value;
+      } else if (key == "include") {
+         spec.include = value;
+      } else if (key == "name") {
+         spec.name = value;
+      } else if (key == "short-name") {
+         spec.shortName = value;
+      } else if (key == "author") {
+         spec.author = value;
+      } else if (key == "icon") {
+         spec.icon = path;
+      } else if (key == "tv-image") {
+         spec.tvImage = path;
+      } else if (key == "drc-image") {
+         spec.drcImage = path;
+      } else if (key == "checksums") {
+         spec.checksums = path;
+      } else {
+         return false;
+      }
+      return true;
+   }
+
+   /* Scans the tree once, each archive then gets a copy whose files read from the shared reader. */
+   struct SharedContent {
+      DirectoryEntry *folder = nullptr;
+      std::unordered_map<FileEntry *, size_t> indices;
+      std::unique_ptr<romfs::SharedContentReader> reader;
+      std::vector<size_t> archives;
+   };
+
+   DirectoryEntry *CloneSharedFolder(const DirectoryEntry *source, const SharedContent &content, size_t consumer) {
+      auto clone = new DirectoryEntry(std::string(source->getName()));
+      for (auto const &child : source->getChildren()) {
+         if (child->isDirNode()) {
+            clone->addChild(CloneSharedFolder(static_cast<DirectoryEntry *>(child), content, consumer));
+         } else {
+            auto file = static_cast<FileEntry *>(child);
+            clone->addChild(new SharedFileEntry(std::string(file->getName()), file->size, content.reader.get(), consumer, content.indices.at(file)));
+         }
+      }
+      return clone;
+   }
+
+   /* The order CreateArchive() writes the folder's files in: tree order, with files from the order list moved to the front. */
+   std::vector<size_t> GetSharedWriteOrder(DirectoryEntry *folder, const std::vector<std::string> &fileOrder) {
+      std::vector<FileEntry *> files;
+      folder->collectFiles(files);
+
+      if (!fileOrder.empty()) {
+         std::unordered_map<std::string, size_t> rank;
+         for (size_t i = 0; i < fileOrder.size(); i++) {
+            rank.emplace(fileOrder[i], i);
+         }
+
+         std::vector<std::pair<size_t, FileEntry *>> ranked;
+         ranked.reserve(files.size());
+         for (auto const &f : files) {
+            auto it = rank.find(f->getFullPath());
+            ranked.emplace_back(it == rank.end() ? fileOrder.size() : it->second, f);
+         }
+         std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<size_t, FileEntry *> &a, const std::pair<size_t, FileEntry *> &b) {
+            return a.first < b.first;
+         });
+         for (size_t i = 0; i < files.size(); i++) {
+            files[i] = ranked[i].second;
+         }
+      }
+
+      std::vector<size_t> order;
+      order.reserve(files.size());
+      for (auto const &f : files) {
+         order.push_back(static_cast<SharedFileEntry *>(f)->getIndex());
+      }
+      return order;
+   }
+
+}
+
+std::vector<ArchiveSpec> readBuildSpec(const char *specPath) {
+   FILE *f_in = fopen(specPath, "r");
+   if (f_in == nullptr) {
+      fprintf(stderr, "Failed to open build spec %s!\n", specPath);
+      exit(EXIT_FAILURE);
+   }
+
+   std::string specFile = specPath;
+#ifndef _WIN32
+   size_t slash = specFile.find_last_of('/');
+#else
+   size_t slash = specFile.find_last_of("/\\");
+#endif
+   std::string baseDir = slash == std::string::npos ? "" : specFile.substr(0, slash + 1);
+
+   ArchiveSpec defaults;
+   std::vector<ArchiveSpec> specs;
+   char line[4096];
+   for (int lineNumber = 1; fgets(line, sizeof(line), f_in); lineNumber++) {
+      std::string entry = Trim(line);
+      if (entry.empty() || entry[0] == '#' || entry[0] == ';') {
+         continue;
+      }
+
+      if (entry == "[archive]") {
+         specs.push_back(defaults);
+         continue;
+      }
+
+      size_t equals = entry.find('=');
+      if (equals == std::string::npos || !SetSpecValue(specs.empty() ? defaults : specs.back(), Trim(entry.substr(0, equals)), Trim(entry.substr(equals + 1)), baseDir)) {
+         fprintf(stderr, "%s:%d: Invalid build spec line: %s\n", specPath, lineNumber, entry.c_str());
+         exit(EXIT_FAILURE);
+      }
+   }
+   fclose(f_in);
+
+   if (specs.empty()) {
+      fprintf(stderr, "Build spec %s has no [archive] sections!\n", specPath);
+      exit(EXIT_FAILURE);
+   }
+
+   for (size_t i = 0; i < specs.size(); i++) {
+      if (specs[i].output.empty() || specs[i].rpx.empty() == specs[i].elf.empty()) {
+         fprintf(stderr, "Archive %zu of %s needs an output and either an rpx or an elf!\n", i + 1, specPath);
+         exit(EXIT_FAILURE);
+      }
+      for (size_t j = 0; j < i; j++) {
+         if (specs[j].output == specs[i].output) {
+            fprintf(stderr, "%s is the output of more than one archive!\n", specs[i].output.c_str());
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+
+   return specs;
+}
+
+void buildArchives(const std::vector<ArchiveSpec> &specs, const TgaGzOptions &tgaGzOptions, const romfs::ArchiveOptions &archiveOptions) {
+   /* Archives with the same content tree and filters share one scan and one read of the data. */
+   std::map<std::string, SharedContent> contents;
+   for (size_t i = 0; i < specs.size(); i++) {
+      if (!specs[i].content.empty()) {
+         contents[specs[i].content + '\n' + specs[i].exclude + '\n' + specs[i].include].archives.push_back(i);
+      }
+   }
+
+   std::vector<std::future<DirectoryEntry *>> scans;
+   for (auto const &content : contents) {
+      const ArchiveSpec &spec = specs[content.second.archives.front()];
+      scans.push_back(std::async(std::launch::async, [&spec]() {
+         romfs::ScanFilter filter;
+         addGlobPatterns(filter.exclude, spec.exclude);
+         addGlobPatterns(filter.include, spec.include);
+
+         filepath_t dirpath;
+         filepath_init(&dirpath);
+         filepath_set(&dirpath, spec.content.c_str());
+         return romfs::CreateFolderFromPath(dirpath, "content", filter);
+      }));
+   }
+
+   std::vector<std::future<FileEntry *>> rpxConversions, icons, tvImages, drcImages;
+   for (auto const &spec : specs) {
+      rpxConversions.push_back(spec.elf.empty() ? std::future<FileEntry *>() : convertElfAsync(spec.elf));
+      icons.push_back(convertImageAsync(spec.icon, "iconTex.tga.gz", 128, 128, 32, tgaGzOptions));
+      tvImages.push_back(convertImageAsync(spec.tvImage, "bootTvTex.tga.gz", 1280, 720, 24, tgaGzOptions));
+      drcImages.push_back(convertImageAsync(spec.drcImage, "bootDrcTex.tga.gz", 854, 480, 24, tgaGzOptions));
+   }
+
+   size_t scan = 0;
+   for (auto &content : contents) {
+      SharedContent &shared = content.second;
+      shared.folder = scans[scan++].get();
+
+      std::vector<FileEntry *> files;
+      shared.folder->collectFiles(files);
+      std::vector<OSFileEntry *> sources;
+      sources.reserve(files.size());
+      for (auto const &f : files) {
+         shared.indices.emplace(f, sources.size());
+         sources.push_back(static_cast<OSFileEntry *>(f));
+      }
+      shared.reader.reset(new romfs::SharedContentReader(std::move(sources), shared.archives.size()));
+   }
+
+   std::vector<RootEntry *> roots(specs.size());
+   std::vector<DirectoryEntry *> contentFolders(specs.size(), nullptr);
+   for (size_t i = 0; i < specs.size(); i++) {
+      const ArchiveSpec &spec = specs[i];
+      roots[i] = new RootEntry();
+
+      auto codeFolder = new DirectoryEntry("code");
+      auto metaFolder = new DirectoryEntry("meta");
+
+      if (rpxConversions[i].valid()) {
+         FileEntry *rpxFile = rpxConversions[i].get();
+         if (!rpxFile) {
+            exit(EXIT_FAILURE);
+         }
+         codeFolder->addChild(rpxFile);
+      } else {
+         codeFolder->addChild(OSFileEntry::fromPath(spec.rpx.c_str(), "root.rpx"));
+      }
+
+      metaFolder->addChild(createMetaIniFileEntry(spec.name, spec.shortName, spec.author.empty() ? "Built with devkitPPC & wut" : spec.author,
+                                                  spec.elf.empty() ? spec.rpx : spec.elf));
+      addConvertedFile(metaFolder, std::move(icons[i]));
+      addConvertedFile(metaFolder, std::move(tvImages[i]));
+      addConvertedFile(metaFolder, std::move(drcImages[i]));
+
+      addFolderIfNotEmpty(roots[i], codeFolder);
+      addFolderIfNotEmpty(roots[i], metaFolder);
+   }
+
+   for (auto &content : contents) {
+      SharedContent &shared = content.second;
+      if (shared.folder->getChildren().empty()) {
+         shared.reader->start({});
+         continue;
+      }
+
+      for (size_t consumer = 0; consumer < shared.archives.size(); consumer++) {
+         size_t archive = shared.archives[consumer];
+         contentFolders[archive] = CloneSharedFolder(shared.folder, shared, consumer);
+         roots[archive]->addChild(contentFolders[archive]);
+      }
+
+      /* Every archive of the group writes the shared files in the same order, see ApplyFileOrder(). */
+      shared.reader->start(GetSharedWriteOrder(contentFolders[shared.archives.front()], archiveOptions.fileOrder));
+   }
+
+   std::vector<std::thread> writers;
+   for (size_t i = 0; i < specs.size(); i++) {
+      writers.emplace_back([&, i]() {
+         romfs::ArchiveOptions options = archiveOptions;
+         options.checksumsPath = specs[i].checksums;
+         romfs::CreateArchive(roots[i], specs[i].output.c_str(), options);
+      });
+   }
+
+   for (auto &writer : writers) {
+      writer.join();
+   }
+
+   for (auto const &root : roots) {
+      delete root;
+   }
+   for (auto &content : contents) {
+      content.second.reader.reset();
+      delete content.second.folder;
+   }
+}
+
+std::future<FileEntry *> convertImageAsync(const std::string &path, const char *name, int width, int height, int bpp, const TgaGzOptions &tgaGzOptions) {
+   if (path.empty())
+      return {};
+
+   // Each image converts on its own thread, overlapping the others and the content scan
+   return std::async(std::launch::async, [=]() {
+      return createTgaGzFileEntry(path.c_str(), width, height, bpp, name, tgaGzOptions);
+   });
+}
+
+std::future<FileEntry *> convertElfAsync(const std::string &path) {
+   // Convert the ELF in memory, overlapping the image conversions and the content scan
+   return std::async(std::launch::async, [=]() -> FileEntry * {
+      std::vector<uint8_t> rpx;
+      if (!elf2rpl::convertElf(path, false, rpx)) {
+         fprintf(stderr, "Failed to convert %s to an RPX\n", path.c_str());
+         return nullptr;
+      }
+      return new BufferFileEntry("root.rpx", std::move(rpx));
+   });
+}
+
+void addConvertedFile(DirectoryEntry *parent, std::future<FileEntry *> &&conversion) {
+   if (!conversion.valid())
+      return;
+
+   FileEntry *file = conversion.get();
+   if (file) {
+      parent->addChild(file);
+   }
+}
+
+FileEntry *createMetaIniFileEntry(std::string long_name, std::string short_name, const std::string &author, const std::string &rpxFilePath) {
+   if (long_name.empty()) {
+      long_name = short_name;
+   }
+   if (short_name.empty()) {
+      short_name = long_name;
+   }
+
+   if (long_name.empty() || short_name.empty()) {
+      size_t startpos = 0, endpos = rpxFilePath.length();
+
+#ifndef _WIN32
+      size_t slash = rpxFilePath.find_last_of('/');
+#else
+      size_t slash = rpxFilePath.find_last_of("/\\");
+#endif
+
+      if (slash != std::string::npos) {
+         startpos = slash+1;
+      }
+
+      size_t dot = rpxFilePath.find_last_of('.');
+      if (dot != std::string::npos) {
+         endpos = dot;
+      }
+
+      long_name = short_name = rpxFilePath.substr(startpos, endpos-startpos);
+   }
+
+#define MAKE_META_INI(_buf,_size) snprintf((_buf),(_size), \
+      "[menu]\n" \
+      "longname=%s\n" \
+      "shortname=%s\n" \
+      "author=%s\n", \
+      long_name.c_str(), \
+      short_name.c_str(), \
+      author.c_str())
+
+   std::vector<uint8_t> metaIniData;
+   metaIniData.reserve(MAKE_META_INI(NULL, 0)+1);
+   metaIniData.resize(metaIniData.capacity()-1);
+   MAKE_META_INI(reinterpret_cast<char*>(metaIniData.data()), metaIniData.capacity());
+
+#undef MAKE_META_INI
+
+   return new BufferFileEntry("meta.ini", std::move(metaIniData));
+}
+
+void addGlobPatterns(std::vector<GlobPattern> &patterns, const std::string &list) {
+   size_t start = 0;
+   while (start <= list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) {
+         end = list.size();
+      }
+      if (end > start) {
+         patterns.emplace_back(list.substr(start, end - start));
+      }
+      start = end + 1;
+   }
+}
+
+void addFolderIfNotEmpty(DirectoryEntry *parent, DirectoryEntry *child) {
+   if (!child->getChildren().empty()) {
+      parent->addChild(child);
+   } else {
+      delete child;
+   }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <future>
+#include <string>
+#include <vector>
+
+#include "RomFSService.h"
+#include "TgaGzService.h"
+#include "../entities/DirectoryEntry.h"
+
+/* One archive of a build spec, see readBuildSpec(). */
+struct ArchiveSpec {
+   std::string output;
+   std::string rpx;
+   std::string elf;
+   std::string content;
+   std::string exclude;
+   std::string include;
+   std::string name;
+   std::string shortName;
+   std::string author;
+   std::string icon;
+   std::string tvImage;
+   std::string drcImage;
+   std::string checksums;
+};
+
+/*
+ * INI-style list of archives: every [archive] section describes one output, keys before the first
+ * section are defaults for all of them. Relative paths are resolved against the spec's directory.
+ */
+std::vector<ArchiveSpec> readBuildSpec(const char *specPath);
+
+/* Builds all archives at once: each distinct content tree is scanned and read only once, and every archive gets its own writer thread. */
+void buildArchives(const std::vector<ArchiveSpec> &specs, const TgaGzOptions &tgaGzOptions, const romfs::ArchiveOptions &archiveOptions);
+
+/* Converts an image on its own thread, an empty path gives an invalid future. */
+std::future<FileEntry *> convertImageAsync(const std::string &path, const char *name, int width, int height, int bpp, const TgaGzOptions &tgaGzOptions);
+std::future<FileEntry *> convertElfAsync(const std::string &path);
+void addConvertedFile(DirectoryEntry *parent, std::future<FileEntry *> &&conversion);
+
+/* Missing names default to each other, then to the RPX file name. */
+FileEntry *createMetaIniFileEntry(std::string longName, std::string shortName, const std::string &author, const std::string &rpxPath);
+
+/* Comma separated list of globs. */
+void addGlobPatterns(std::vector<GlobPattern> &patterns, const std::string &list);
+
+void addFolderIfNotEmpty(DirectoryEntry *parent, DirectoryEntry *child);
@@ -1,8 +1,19 @@
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
 #include "RomFSService.h"
 #include "../utils/utils.h"
+#include "../utils/timing.h"
 #include "../entities/OSFileEntry.h"
 
 namespace romfs {
@@ -17,7 +28,8 @@ namespace {
       }
    }
 
-   uint32_t GetHashTableCount(uint32_t num_entries) {
+   uint32_t GetHashTableCount(uint32_t num_entries, double load_factor) {
+      num_entries = static_cast<uint32_t>(std::ceil(num_entries / load_factor));
       if (num_entries < 3) {
          return 3;
       } else if (num_entries < 19) {
@@ -30,6 +42,323 @@ namespace {
       return count;
    }
 
+   template <typename T>
+   void PrintHashStats(const char *name, const uint32_t *hash_table, uint32_t bucket_count, const T *table) {
+      uint32_t empty_buckets = 0;
+      uint32_t max_chain = 0;
+      uint64_t num_entries = 0;
+      uint64_t lookup_depth = 0;
+
+      for (uint32_t i = 0; i < bucket_count; i++) {
+         uint32_t chain = 0;
+         for (uint32_t ofs = be_word(hash_table[i]); ofs != ROMFS_ENTRY_EMPTY; chain++) {
+            ofs = be_word(reinterpret_cast<const T *>(reinterpret_cast<const char *>(table) + ofs)->hash);
+         }
+
+         if (chain == 0) {
+            empty_buckets++;
+         }
+         max_chain = std::max(max_chain, chain);
+         num_entries += chain;
+         /* Finding the n-th entry of a chain walks n entries. */
+         lookup_depth += static_cast<uint64_t>(chain) * (chain + 1) / 2;
+      }
+
+      uint32_t used_buckets = bucket_count - empty_buckets;
+      printf("%s hash table: %u buckets, %llu entries, %u empty (%.1f%%), max chain %u, mean chain %.2f, mean lookup depth %.2f\n",
+             name, bucket_count, static_cast<unsigned long long>(num_entries), empty_buckets,
+             100.0 * empty_buckets / bucket_count, max_chain,
+             used_buckets ? static_cast<double>(num_entries) / used_buckets : 0.0,
+             num_entries ? static_cast<double>(lookup_depth) / num_entries : 0.0);
+   }
+
+   /* Returns whether the filter dropped anything below dirpath. */
+   bool ScanFolder(DirectoryEntry *curDir, filepath_t &dirpath, const std::string &relpath, const ScanFilter &filter, const std::function<void(FileEntry *)> &onFile) {
+      osdirent_t *cur_dirent = nullptr;
+      filepath_t cur_path;
+      filepath_t cur_sum_path;
+      os_stat64_t cur_stats;
+
+      osdir_t *dir = nullptr;
+      if ((dir = os_opendir(dirpath.os_path)) == nullptr) {
+         fprintf(stderr, "Failed to open directory %s!\n", dirpath.char_path);
+         exit(EXIT_FAILURE);
+      }
+
+      std::vector<std::string> names;
+      while ((cur_dirent = os_readdir(dir))) {
+         filepath_init(&cur_path);
+         filepath_set(&cur_path, "");
+         filepath_os_set(&cur_path, cur_dirent->d_name);
+
+         if (strcmp(cur_path.char_path, ".") == 0 || strcmp(cur_path.char_path, "..") == 0) {
+            /* Special case . and .. */
+            continue;
+         }
+
+         names.emplace_back(cur_path.char_path);
+      }
+
+      os_closedir(dir);
+
+      /* readdir order depends on the host filesystem, sort by (UTF-8) name bytes so identical trees give identical archives. */
+      std::sort(names.begin(), names.end());
+
+      bool filtered = false;
+      std::vector<FileEntry *> files;
+      for (auto const &cur_name : names) {
+         filepath_copy(&cur_sum_path, &dirpath);
+         filepath_append(&cur_sum_path, "%s", cur_name.c_str());
+         std::string cur_relpath = relpath.empty() ? cur_name : relpath + "/" + cur_name;
+
+         if (os_stat(cur_sum_path.os_path, &cur_stats) == -1) {
+            /* Excluded broken links and the like don't need to be readable. */
+            if (filter.isExcluded(cur_relpath, false)) {
+               filtered = true;
+               continue;
+            }
+            fprintf(stderr, "Failed to stat %s\n", cur_sum_path.char_path);
+            exit(EXIT_FAILURE);
+         }
+
+         bool is_dir = (cur_stats.st_mode & S_IFMT) == S_IFDIR;
+         if (filter.isExcluded(cur_relpath, is_dir) || (!is_dir && !filter.isIncluded(cur_relpath))) {
+            filtered = true;
+            continue;
+         }
+
+         if (is_dir) {
+            /* Attach before descending, so paths of reported files are complete. */
+            auto directoryEntry = new DirectoryEntry(cur_name.c_str());
+            curDir->addChild(directoryEntry);
+            if (ScanFolder(directoryEntry, cur_sum_path, cur_relpath, filter, onFile)) {
+               filtered = true;
+               /* Drop directories the filter emptied, empty source directories are kept as before. */
+               if (directoryEntry->getChildren().empty()) {
+                  curDir->removeChild(directoryEntry);
+                  delete directoryEntry;
+               }
+            }
+         } else if ((cur_stats.st_mode & S_IFMT) == S_IFREG) {
+            auto fileEntry = new OSFileEntry(cur_sum_path, cur_name.c_str());
+            fileEntry->size = cur_stats.st_size;
+            curDir->addChild(fileEntry);
+            files.push_back(fileEntry);
+         } else {
+            fprintf(stderr, "Invalid FS object type for %s!\n", cur_name.c_str());
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      /* A directory's files are laid out after all of its subdirectories. */
+      if (onFile) {
+         for (auto const &f : files) {
+            onFile(f);
+         }
+      }
+
+      return filtered;
+   }
+
+   typedef std::vector<std::pair<FileEntry *, HashStream *>> file_checksums_t;
+
+   /* Reserves the whole archive up front so large outputs aren't grown extent by extent, unwritten ranges still read as zeros. */
+   bool PreallocateOutput(FILE *f_out, uint64_t size) {
+#if defined(HAVE_FALLOCATE)
+      /* Unlike posix_fallocate(), this fails instead of writing zeros where the filesystem can't preallocate. */
+      return fallocate(fileno(f_out), 0, 0, static_cast<off_t>(size)) == 0;
+#elif defined(HAVE_POSIX_FALLOCATE)
+      return posix_fallocate(fileno(f_out), 0, static_cast<off_t>(size)) == 0;
+#else
+      (void) f_out;
+      (void) size;
+      return false;
+#endif
+   }
+
+   /* Preallocation for the pipelined layout, whose final size is only known once the scan is done: the output is reserved in large steps ahead of the files being placed. */
+   class GrowingReservation {
+   public:
+      explicit GrowingReservation(FILE *f_out) : f_out(f_out) {
+      }
+
+      /* Reserves the output up to end, false once the filesystem refused. */
+      bool reserve(uint64_t end) {
+#if defined(HAVE_FALLOCATE)
+         if (!failed && end > reserved) {
+            uint64_t target = align<uint64_t>(end, Step);
+            /* The file size is left to the writes, only the blocks are allocated. */
+            failed = fallocate(fileno(f_out), FALLOC_FL_KEEP_SIZE, static_cast<off_t>(reserved), static_cast<off_t>(target - reserved)) != 0;
+            reserved = target;
+         }
+         return !failed;
+#else
+         (void) end;
+         return false;
+#endif
+      }
+
+      /* Frees what was reserved past the end of the finished archive. */
+      void trim(uint64_t size) {
+#if defined(HAVE_FALLOCATE)
+         if (reserved > size) {
+            fflush(f_out);
+            if (ftruncate(fileno(f_out), static_cast<off_t>(size)) != 0) {
+               fprintf(stderr, "Failed to truncate output!\n");
+               exit(EXIT_FAILURE);
+            }
+         }
+#else
+         (void) size;
+#endif
+      }
+
+   private:
+      static const uint64_t Step = 0x4000000;
+
+      FILE *f_out;
+      uint64_t reserved = 0;
+      bool failed = false;
+   };
+
+   /* Padding is never written, check that it reads back as zeros from the preallocated file. */
+   void CheckPadding(filepath_t &outpath, const std::vector<std::pair<uint64_t, uint64_t>> &gaps) {
+      FILE *f_in = os_fopen(outpath.os_path, OS_MODE_READ);
+      if (f_in == nullptr) {
+         fprintf(stderr, "Failed to open %s!\n", outpath.char_path);
+         exit(EXIT_FAILURE);
+      }
+      setvbuf(f_in, nullptr, _IONBF, 0);
+
+      char buffer[ROMFS_FILEPARTITION_OFS];
+      for (auto const &gap : gaps) {
+         if (fseeko64(f_in, gap.first, SEEK_SET) != 0) {
+            fprintf(stderr, "Failed to seek!\n");
+            exit(EXIT_FAILURE);
+         }
+         for (uint64_t offset = gap.first; offset < gap.second;) {
+            size_t size = static_cast<size_t>(std::min<uint64_t>(gap.second - offset, sizeof(buffer)));
+            if (fread(buffer, 1, size, f_in) != size) {
+               fprintf(stderr, "Failed to read back padding of %s!\n", outpath.char_path);
+               exit(EXIT_FAILURE);
+            }
+            for (size_t i = 0; i < size; i++) {
+               if (buffer[i] != 0) {
+                  fprintf(stderr, "Padding at 0x%llx of %s isn't zero!\n", static_cast<unsigned long long>(offset + i), outpath.char_path);
+                  exit(EXIT_FAILURE);
+               }
+            }
+            offset += size;
+         }
+      }
+
+      os_fclose(f_in);
+   }
+
+   void WriteFile(FileEntry *file, FILE *f_out, off_t base_offset, HashPool *hashPool, file_checksums_t &checksums) {
+      if (hashPool == nullptr) {
+         file->write(f_out, base_offset);
+         return;
+      }
+
+      /* The digest is finished by the pool later on, the writer moves on to the next file right away. */
+      HashStream *stream = hashPool->open();
+      file->checksum = stream;
+      file->write(f_out, base_offset);
+      file->checksum = nullptr;
+      stream->close();
+      checksums.emplace_back(file, stream);
+   }
+
+   std::string JsonEscape(const std::string &str) {
+      std::string escaped;
+      escaped.reserve(str.size());
+      for (unsigned char c : str) {
+         if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+         } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+         } else {
+            escaped += c;
+         }
+      }
+      return escaped;
+   }
+
+   void WriteChecksums(const ArchiveOptions &options, file_checksums_t &checksums) {
+      filepath_t outpath;
+      filepath_init(&outpath);
+      filepath_set(&outpath, options.checksumsPath.c_str());
+
+      FILE *f_out = os_fopen(outpath.os_path, OS_MODE_WRITE);
+      if (f_out == nullptr) {
+         fprintf(stderr, "Failed to open %s!\n", outpath.char_path);
+         exit(EXIT_FAILURE);
+      }
+
+      /* Pipelined files report in write order, list everything by partition offset. */
+      std::stable_sort(checksums.begin(), checksums.end(), [](const file_checksums_t::value_type &a, const file_checksums_t::value_type &b) {
+         return a.first->offset < b.first->offset;
+      });
+
+      const char *algorithm = checksum_type_name(options.checksumType);
+      fprintf(f_out, "{\n  \"algorithm\": \"%s\",\n  \"files\": [", algorithm);
+      for (size_t i = 0; i < checksums.size(); i++) {
+         FileEntry *f = checksums[i].first;
+         fprintf(f_out, "%s\n    { \"path\": \"%s\", \"offset\": %llu, \"size\": %llu, \"%s\": \"%s\" }",
+                 i ? "," : "", JsonEscape(f->getFullPath()).c_str(),
+                 static_cast<unsigned long long>(f->offset + ROMFS_FILEPARTITION_OFS), static_cast<unsigned long long>(f->size),
+                 algorithm, checksums[i].second->digest().c_str());
+      }
+      fprintf(f_out, "\n  ]\n}\n");
+
+      if (os_fclose(f_out) != 0) {
+         fprintf(stderr, "Failed to write %s!\n", outpath.char_path);
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   void ApplyFileOrder(std::vector<FileEntry *> &files, romfs_ctx_t *romfs_ctx, const std::vector<std::string> &fileOrder) {
+      std::unordered_map<std::string, FileEntry *> filesByPath;
+      filesByPath.reserve(files.size());
+      for (auto const &f : files) {
+         filesByPath.emplace(f->getFullPath(), f);
+      }
+
+      std::vector<FileEntry *> layout;
+      std::unordered_set<FileEntry *> placed;
+      layout.reserve(files.size());
+      for (auto const &path : fileOrder) {
+         auto it = filesByPath.find(path);
+         if (it == filesByPath.end()) {
+            fprintf(stderr, "Warning: %s from order file is not part of the archive, ignoring...\n", path.c_str());
+            continue;
+         }
+         if (placed.insert(it->second).second) {
+            layout.push_back(it->second);
+         }
+      }
+
+      /* Unlisted files keep their tree order behind the ordered block. */
+      for (auto const &f : files) {
+         if (!placed.count(f)) {
+            layout.push_back(f);
+         }
+      }
+
+      romfs_ctx->file_partition_size = 0;
+      for (auto const &f : layout) {
+         romfs_ctx->file_partition_size = align<uint64_t>(romfs_ctx->file_partition_size, 0x10);
+         f->offset = romfs_ctx->file_partition_size;
+         romfs_ctx->file_partition_size += f->size;
+      }
+
+      files = std::move(layout);
+   }
+
 }
 
 uint32_t CalcPathHash(uint32_t parent, const unsigned char *path, uint32_t start, size_t path_len) {
@@ -42,56 +371,166 @@ uint32_t CalcPathHash(uint32_t parent, const unsigned char *path, uint32_t start
    return hash;
 }
 
-DirectoryEntry *CreateFolderFromPath(filepath_t &dirpath, const char *name) {
-   osdirent_t *cur_dirent = nullptr;
-   filepath_t cur_path;
-   filepath_t cur_sum_path;
-   os_stat64_t cur_stats;
+bool ScanFilter::isExcluded(const std::string &path, bool isDirectory) const {
+   for (auto const &pattern : exclude) {
+      if (pattern.matches(path, isDirectory)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+bool ScanFilter::isIncluded(const std::string &path) const {
+   if (include.empty()) {
+      return true;
+   }
+   for (auto const &pattern : include) {
+      if (pattern.matches(path, false)) {
+         return true;
+      }
+   }
+   return false;
+}
 
+DirectoryEntry *CreateFolderFromPath(filepath_t &dirpath, const char *name, const ScanFilter &filter) {
    auto *curDir = new DirectoryEntry(name);
+   ScanFolder(curDir, dirpath, "", filter, nullptr);
+   return curDir;
+}
 
-   osdir_t *dir = nullptr;
-   if ((dir = os_opendir(dirpath.os_path)) == nullptr) {
-      fprintf(stderr, "Failed to open directory %s!\n", dirpath.char_path);
-      exit(EXIT_FAILURE);
+PipelinedFolderScan::PipelinedFolderScan(filepath_t &dirpath, const char *name, const ScanFilter &filter) : filter(filter), folder(new DirectoryEntry(name)) {
+   filepath_copy(&this->dirpath, &dirpath);
+
+   thread = std::thread([this]() {
+      uint64_t partition_size = 0;
+
+      ScanFolder(folder, this->dirpath, "", this->filter, [this, &partition_size](FileEntry *file) {
+         /* Offsets relative to the folder's first file, the same layout calculateFileOffsets() produces. */
+         partition_size = align<uint64_t>(partition_size, 0x10);
+         file->offset = partition_size;
+         partition_size += file->size;
+
+         std::unique_lock<std::mutex> lock(mutex);
+         notFull.wait(lock, [this]() { return queue.size() < MaxQueuedFiles; });
+         queue.push_back(file);
+         notEmpty.notify_one();
+      });
+
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+      notEmpty.notify_one();
+   });
+}
+
+PipelinedFolderScan::~PipelinedFolderScan() {
+   if (thread.joinable()) {
+      thread.join();
+      delete folder;
    }
+}
 
-   while ((cur_dirent = os_readdir(dir))) {
-      filepath_init(&cur_path);
-      filepath_set(&cur_path, "");
-      filepath_os_set(&cur_path, cur_dirent->d_name);
+FileEntry *PipelinedFolderScan::next() {
+   std::unique_lock<std::mutex> lock(mutex);
+   notEmpty.wait(lock, [this]() { return !queue.empty() || done; });
+   if (queue.empty()) {
+      return nullptr;
+   }
 
-      if (strcmp(cur_path.char_path, ".") == 0 || strcmp(cur_path.char_path, "..") == 0) {
-         /* Special case . and .. */
+   FileEntry *file = queue.front();
+   queue.pop_front();
+   notFull.notify_one();
+   return file;
+}
+
+DirectoryEntry *PipelinedFolderScan::finish() {
+   thread.join();
+   return folder;
+}
+
+std::vector<std::string> ReadFileOrder(const char *orderFilePath) {
+   std::vector<std::string> order;
+
+   FILE *f_in = fopen(orderFilePath, "r");
+   if (f_in == nullptr) {
+      fprintf(stderr, "Failed to open order file %s!\n", orderFilePath);
+      exit(EXIT_FAILURE);
+   }
+
+   char line[MAX_OSPATH + 2];
+   while (fgets(line, sizeof(line), f_in)) {
+      std::string path = line;
+      path.erase(path.find_last_not_of(" \t\r\n") + 1);
+      path.erase(0, path.find_first_not_of(" \t"));
+      if (path.empty() || path[0] == '#') {
          continue;
       }
 
-      filepath_copy(&cur_sum_path, &dirpath);
-      filepath_os_append(&cur_sum_path, cur_dirent->d_name);
+      std::replace(path.begin(), path.end(), '\\', '/');
+      if (path[0] != '/') {
+         path.insert(0, OS_PATH_SEPARATOR);
+      }
+      order.push_back(std::move(path));
+   }
 
-      if (os_stat(cur_sum_path.os_path, &cur_stats) == -1) {
-         fprintf(stderr, "Failed to stat %s\n", cur_sum_path.char_path);
-         exit(EXIT_FAILURE);
+   fclose(f_in);
+   return order;
+}
+
+void CreateArchive(DirectoryEntry *root, const char *outputFilePath, const ArchiveOptions &options, PipelinedFolderScan *contentScan, PhaseTimer *callerTimer) {
+   if (contentScan && !options.fileOrder.empty()) {
+      fprintf(stderr, "A file order can't be applied to a pipelined content scan!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   filepath_t outpath;
+   filepath_init(&outpath);
+   filepath_set(&outpath, outputFilePath);
+
+   off_t base_offset = 0;
+   FILE *f_out = nullptr;
+
+   if ((f_out = os_fopen(outpath.os_path, OS_MODE_WRITE)) == NULL) {
+      fprintf(stderr, "Failed to open %s!\n", outpath.char_path);
+      exit(EXIT_FAILURE);
+   }
+
+   file_checksums_t checksums;
+   std::unique_ptr<HashPool> hashPool;
+   if (!options.checksumsPath.empty()) {
+      hashPool.reset(new HashPool(options.checksumType));
+   }
+   PhaseTimer ownTimer(options.printTimings && callerTimer == nullptr);
+   PhaseTimer &timer = callerTimer ? *callerTimer : ownTimer;
+   GrowingReservation reservation(f_out);
+
+   if (contentScan) {
+      /* Everything in the tree so far is laid out before the scanned folder, so its data can be written while the scan is still running. */
+      romfs_ctx_t base_ctx;
+      memset(&base_ctx, 0, sizeof(base_ctx));
+      root->calculateFileOffsets(&base_ctx, nullptr);
+
+      std::vector<FileEntry *> files;
+      root->collectFiles(files);
+      off_t content_offset = base_offset + align<uint64_t>(base_ctx.file_partition_size, 0x10);
+      reservation.reserve(content_offset + ROMFS_FILEPARTITION_OFS);
+      for (auto const &f : files) {
+         WriteFile(f, f_out, base_offset, hashPool.get(), checksums);
       }
 
-      if ((cur_stats.st_mode & S_IFMT) == S_IFDIR) {
-         auto directoryEntry = CreateFolderFromPath(cur_sum_path, cur_path.char_path);
-         curDir->addChild(directoryEntry);
-      } else if ((cur_stats.st_mode & S_IFMT) == S_IFREG) {
-         auto fileEntry = new OSFileEntry(cur_sum_path, cur_path.char_path);
-         fileEntry->size = cur_stats.st_size;
-         curDir->addChild(fileEntry);
+      while (FileEntry *f = contentScan->next()) {
+         reservation.reserve(content_offset + ROMFS_FILEPARTITION_OFS + f->offset + f->size);
+         WriteFile(f, f_out, content_offset, hashPool.get(), checksums);
+      }
+
+      DirectoryEntry *contentFolder = contentScan->finish();
+      if (!contentFolder->getChildren().empty()) {
+         root->addChild(contentFolder);
       } else {
-         fprintf(stderr, "Invalid FS object type for %s!\n", cur_path.char_path);
-         exit(EXIT_FAILURE);
+         delete contentFolder;
       }
+      timer.lap("scan+write");
    }
 
-   os_closedir(dir);
-   return curDir;
-}
-
-void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
    romfs_ctx_t romfs_ctx;
    memset(&romfs_ctx, 0, sizeof(romfs_ctx));
 
@@ -100,8 +539,8 @@ void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
 
    root->fillRomFSInformation(&romfs_ctx);
 
-   uint32_t dir_hash_table_entry_count = GetHashTableCount(romfs_ctx.num_dirs);
-   uint32_t file_hash_table_entry_count = GetHashTableCount(romfs_ctx.num_files);
+   uint32_t dir_hash_table_entry_count = GetHashTableCount(romfs_ctx.num_dirs, options.hashLoadFactor);
+   uint32_t file_hash_table_entry_count = GetHashTableCount(romfs_ctx.num_files, options.hashLoadFactor);
    romfs_ctx.dir_hash_table_size = 4 * dir_hash_table_entry_count;
    romfs_ctx.file_hash_table_size = 4 * file_hash_table_entry_count;
 
@@ -150,11 +589,25 @@ void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
    root->calculateDirOffsets(&romfs_ctx, &entry_offset);
    entry_offset = 0;
    root->calculateFileOffsets(&romfs_ctx, &entry_offset);
+
+   std::vector<FileEntry *> files;
+   files.reserve(romfs_ctx.num_files);
+   root->collectFiles(files);
+   if (!options.fileOrder.empty()) {
+      printf("Applying file order...\n");
+      ApplyFileOrder(files, &romfs_ctx, options.fileOrder);
+   }
    printf("Updating sibling and child entries...\n");
    root->updateSiblingAndChildEntries();
    printf("Populating data...\n");
    root->populate(&infos);
 
+   if (options.printHashStats) {
+      PrintHashStats("Directory", dir_hash_table, dir_hash_table_entry_count, dir_table);
+      PrintHashStats("File", file_hash_table, file_hash_table_entry_count, file_table);
+   }
+   timer.lap("metadata");
+
    romfs_header_t header;
    memset(&header, 0, sizeof(header));
 
@@ -177,16 +630,12 @@ void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
    header.file_hash_table_ofs = be_dword(header.file_hash_table_ofs);
    header.file_table_ofs = be_dword(header.file_table_ofs);
 
-   filepath_t outpath;
-   filepath_init(&outpath);
-   filepath_set(&outpath, outputFilePath);
-
-   off_t base_offset = 0;
-   FILE *f_out = nullptr;
-
-   if ((f_out = os_fopen(outpath.os_path, OS_MODE_WRITE)) == NULL) {
-      fprintf(stderr, "Failed to open %s!\n", outpath.char_path);
-      exit(EXIT_FAILURE);
+   /* Nothing is written to the alignment gaps, they stay holes (or unwritten extents when preallocated). */
+   uint64_t archive_size = dir_hash_table_ofs + romfs_ctx.dir_hash_table_size + romfs_ctx.dir_table_size + romfs_ctx.file_hash_table_size + romfs_ctx.file_table_size;
+   bool preallocated = false;
+   if (base_offset == 0) {
+      /* The pipelined layout already reserved its files, the tables at the end are added to that. */
+      preallocated = contentScan ? reservation.reserve(archive_size) : PreallocateOutput(f_out, archive_size);
    }
 
    printf("Writing header...\n");
@@ -196,7 +645,13 @@ void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
    }
    fwrite(&header, 1, sizeof(header), f_out);
 
-   root->write(f_out, base_offset);
+   if (!contentScan) {
+      /* Files are written in partition order so the output is filled sequentially. */
+      for (auto const &f : files) {
+         WriteFile(f, f_out, base_offset, hashPool.get(), checksums);
+      }
+   }
+   timer.lap("write");
 
    printf("Writing dir_hash_table...\n");
    if(fseeko64(f_out, base_offset + dir_hash_table_ofs, SEEK_SET) != 0){
@@ -229,7 +684,44 @@ void CreateArchive(DirectoryEntry *root, const char *outputFilePath) {
       exit(EXIT_FAILURE);
    }
    free(file_table);
+   if (contentScan) {
+      reservation.trim(archive_size);
+   }
    fclose(f_out);
+   timer.lap("tables");
+
+   if (preallocated) {
+      std::vector<std::pair<uint64_t, uint64_t>> gaps;
+      uint64_t end = sizeof(header);
+      auto addGap = [&gaps](uint64_t start, uint64_t stop) {
+         if (stop > start) {
+            gaps.emplace_back(start, stop);
+         }
+      };
+      std::sort(files.begin(), files.end(), [](const FileEntry *a, const FileEntry *b) { return a->offset < b->offset; });
+      for (auto const &f : files) {
+         addGap(end, f->offset + ROMFS_FILEPARTITION_OFS);
+         end = std::max<uint64_t>(end, f->offset + ROMFS_FILEPARTITION_OFS + f->size);
+      }
+      addGap(end, dir_hash_table_ofs);
+      CheckPadding(outpath, gaps);
+      timer.lap("padding");
+   }
+
+   if (!options.checksumsPath.empty()) {
+      printf("Writing checksums...\n");
+      hashPool->wait();
+      WriteChecksums(options, checksums);
+      timer.lap("checksums");
+   }
+
+   if (timer.isEnabled()) {
+      double seconds = timer.elapsed();
+      double megabytes = romfs_ctx.file_partition_size / (1024.0 * 1024.0);
+      printf("Timing: total %.3f s, %llu files (%.0f files/s), %.1f MiB (%.1f MiB/s), peak RSS %.1f MiB\n",
+             seconds, static_cast<unsigned long long>(romfs_ctx.num_files), romfs_ctx.num_files / seconds,
+             megabytes, megabytes / seconds, get_peak_rss() / (1024.0 * 1024.0));
+   }
 }
 
 }
@@ -1,11 +1,45 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "RomFSStructs.h"
+#include "../utils/checksum.h"
+#include "../utils/glob.h"
 #include "../entities/DirectoryEntry.h"
 
+class PhaseTimer;
+
 namespace romfs {
 
+   struct ArchiveOptions {
+      /* Full archive paths (e.g. /content/foo.bin) whose data is laid out first, in this order. */
+      std::vector<std::string> fileOrder;
+      /* Average number of entries per hash bucket, lower values mean shorter chains but larger tables. */
+      double hashLoadFactor = 1.0;
+      bool printHashStats = false;
+      /* Print the wall time of each phase, throughput and peak RSS. */
+      bool printTimings = false;
+      /* Manifest of per-file checksums computed while the data is written, empty to disable. */
+      std::string checksumsPath;
+      ChecksumType checksumType = ChecksumType::SHA256;
+   };
+
+   /* --include/--exclude globs, matched against paths relative to the scanned folder. */
+   struct ScanFilter {
+      std::vector<GlobPattern> include;
+      std::vector<GlobPattern> exclude;
+
+      /* Excluded directories are never descended into. */
+      bool isExcluded(const std::string &path, bool isDirectory) const;
+      /* Without include patterns every file is included. */
+      bool isIncluded(const std::string &path) const;
+   };
+
    inline romfs_direntry_t *GetDirEntry(romfs_direntry_t *directories, uint32_t offset) {
       return (romfs_direntry_t *) ((char *) directories + offset);
    }
@@ -14,8 +48,38 @@ namespace romfs {
       return (romfs_fentry_t *) ((char *) files + offset);
    }
 
+   /* Scans a folder on a worker thread and hands out its files in partition order while the scan is still running. */
+   class PipelinedFolderScan {
+   public:
+      PipelinedFolderScan(filepath_t &dirpath, const char *name, const ScanFilter &filter = ScanFilter());
+      ~PipelinedFolderScan();
+
+      /* Next scanned file with its offset relative to the folder's data, nullptr once the scan is done. */
+      FileEntry *next();
+
+      /* Waits for the scan and hands over the folder. */
+      DirectoryEntry *finish();
+
+   private:
+      static constexpr size_t MaxQueuedFiles = 4096;
+
+      filepath_t dirpath;
+      ScanFilter filter;
+      DirectoryEntry *folder;
+
+      std::thread thread;
+      std::mutex mutex;
+      std::condition_variable notEmpty;
+      std::condition_variable notFull;
+      std::deque<FileEntry *> queue;
+      bool done = false;
+   };
+
    uint32_t CalcPathHash(uint32_t parent, const unsigned char *path, uint32_t start, size_t path_len);
-   DirectoryEntry *CreateFolderFromPath(filepath_t &dirpath, const char *name);
-   void CreateArchive(DirectoryEntry *root, const char *outputFilePath);
+   DirectoryEntry *CreateFolderFromPath(filepath_t &dirpath, const char *name, const ScanFilter &filter = ScanFilter());
+   std::vector<std::string> ReadFileOrder(const char *orderFilePath);
+   /* With a contentScan its data is written as it's scanned, and the folder is added to root as the last child.
+    * A caller's timer is continued, so work it timed before (like scanning the content) counts towards the totals. */
+   void CreateArchive(DirectoryEntry *root, const char *outputFilePath, const ArchiveOptions &options = ArchiveOptions(), PipelinedFolderScan *contentScan = nullptr, PhaseTimer *callerTimer = nullptr);
 
 }
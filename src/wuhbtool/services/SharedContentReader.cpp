@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <algorithm>
+#include "SharedContentReader.h"
+
+namespace romfs {
+
+SharedContentReader::SharedContentReader(std::vector<OSFileEntry *> &&sources, size_t consumers) : sources(std::move(sources)), cursors(consumers, 0) {
+}
+
+SharedContentReader::~SharedContentReader() {
+   if (thread.joinable()) {
+      thread.join();
+   }
+}
+
+void SharedContentReader::start(std::vector<size_t> &&order) {
+   this->order = std::move(order);
+   thread = std::thread([this]() { read(); });
+}
+
+void SharedContentReader::read() {
+   for (auto const &index : order) {
+      OSFileEntry *source = sources[index];
+
+      FILE *f_in = os_fopen(source->getOSPath().os_path, OS_MODE_READ);
+      if (f_in == nullptr) {
+         fprintf(stderr, "Failed to open %s!\n", source->getOSPath().char_path);
+         exit(EXIT_FAILURE);
+      }
+
+      /* Empty files still get a chunk, so consumers see where they end. */
+      uint64_t offset = 0;
+      do {
+         auto chunk = std::unique_ptr<Chunk>(new Chunk());
+         size_t size = static_cast<size_t>(std::min<uint64_t>(source->size - offset, ChunkSize));
+         chunk->index = index;
+         chunk->data.resize(size);
+         if (fread(chunk->data.data(), 1, size, f_in) != size) {
+            fprintf(stderr, "Failed to read from %s!\n", source->getOSPath().char_path);
+            exit(EXIT_FAILURE);
+         }
+         offset += size;
+         chunk->last = offset >= source->size;
+
+         std::unique_lock<std::mutex> lock(mutex);
+         writable.wait(lock, [this]() { return bufferedBytes < MaxBufferedBytes; });
+         bufferedBytes += size;
+         chunks.push_back(std::move(chunk));
+         readable.notify_all();
+      } while (offset < source->size);
+
+      os_fclose(f_in);
+   }
+}
+
+void SharedContentReader::write(size_t consumer, size_t index, FILE *f_out, HashStream *checksum) {
+   bool last = false;
+   while (!last) {
+      Chunk *chunk;
+      {
+         std::unique_lock<std::mutex> lock(mutex);
+         readable.wait(lock, [this, consumer]() { return cursors[consumer] < firstChunk + chunks.size(); });
+         chunk = chunks[cursors[consumer] - firstChunk].get();
+      }
+
+      /* Chunks stay alive until every consumer passed them, so they can be used without the lock. */
+      if (chunk->index != index) {
+         fprintf(stderr, "Shared content is written in a different order than it's read!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      if (fwrite(chunk->data.data(), 1, chunk->data.size(), f_out) != chunk->data.size()) {
+         fprintf(stderr, "Failed to write to output!\n");
+         exit(EXIT_FAILURE);
+      }
+      if (checksum) {
+         checksum->update(chunk->data.data(), chunk->data.size());
+      }
+      last = chunk->last;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      cursors[consumer]++;
+      uint64_t slowest = *std::min_element(cursors.begin(), cursors.end());
+      while (firstChunk < slowest) {
+         bufferedBytes -= chunks.front()->data.size();
+         chunks.pop_front();
+         firstChunk++;
+         writable.notify_one();
+      }
+   }
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "../entities/OSFileEntry.h"
+#include "../utils/hashpool.h"
+
+namespace romfs {
+
+   /* Reads a set of source files once and hands every chunk to all archives that contain them. */
+   class SharedContentReader {
+   public:
+      SharedContentReader(std::vector<OSFileEntry *> &&sources, size_t consumers);
+      ~SharedContentReader();
+
+      /* Starts reading the sources in this order, which every consumer has to follow. */
+      void start(std::vector<size_t> &&order);
+
+      /* Copies source index to f_out at its current position, blocking until the data was read. */
+      void write(size_t consumer, size_t index, FILE *f_out, HashStream *checksum);
+
+   private:
+      static constexpr size_t ChunkSize = 0x100000;
+      /* Bytes held for consumers lagging behind, the reader waits once it's this far ahead of the slowest one. */
+      static constexpr size_t MaxBufferedBytes = 0x4000000;
+
+      struct Chunk {
+         size_t index;
+         std::vector<uint8_t> data;
+         bool last;
+      };
+
+      void read();
+
+      std::vector<OSFileEntry *> sources;
+      std::vector<size_t> order;
+
+      std::thread thread;
+      std::mutex mutex;
+      std::condition_variable readable;
+      std::condition_variable writable;
+      std::deque<std::unique_ptr<Chunk>> chunks;
+      /* Sequence number of chunks.front(), and of the next chunk each consumer needs. */
+      uint64_t firstChunk = 0;
+      std::vector<uint64_t> cursors;
+      size_t bufferedBytes = 0;
+   };
+
+}
@@ -1,126 +1,277 @@
 #include "TgaGzService.h"
 #include "../entities/BufferFileEntry.h"
+#include "../utils/filepath.h"
 #include <vector>
+#include <cstdio>
 #include <zlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <functional>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 namespace {
 
-   struct FiMemoryFile {
-      std::vector<uint8_t> data;
-      long pos;
+   constexpr size_t TgaHeaderSize = 18;
+   constexpr size_t TgaFooterSize = 26;
+
+   /* zlib deflate into an output buffer presized with deflateBound(), so every write compresses in place. */
+   class GzWriter {
+   public:
+      GzWriter(int level, size_t rawSize) : z{} {
+         deflateInit2(&z, level, Z_DEFLATED, MAX_WBITS | 16, 8, Z_DEFAULT_STRATEGY);
 
-      FiMemoryFile() : data{}, pos{} { }
+         /* Pin the gzip header (no mtime, fixed OS byte) so the output doesn't depend on the host zlib was built for. */
+         header = {};
+         header.os = 3;
+         deflateSetHeader(&z, &header);
 
-      long getSize() {
-         return pos > data.size() ? pos : data.size();
+         buffer.resize(deflateBound(&z, rawSize));
+         z.next_out = buffer.data();
+         z.avail_out = buffer.size();
       }
 
-      void ensureSize() {
-         if (pos > data.size()) {
-            data.resize(pos);
+      ~GzWriter() {
+         deflateEnd(&z);
+      }
+
+      void write(const void* data, size_t size) {
+         z.avail_in = size;
+         z.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+
+         if (deflate(&z, Z_NO_FLUSH) != Z_OK || z.avail_in != 0) {
+            fprintf(stderr, "Zlib compression error\n");
+            exit(EXIT_FAILURE);
          }
       }
 
-      /*
-      unsigned read(void *buffer, unsigned size, unsigned count) {
-         // etc
+      std::vector<uint8_t> finish() {
+         if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "Zlib compression error\n");
+            exit(EXIT_FAILURE);
+         }
+
+         buffer.resize(z.total_out);
+         return std::move(buffer);
       }
-      */
 
-      unsigned write(const void *buffer, unsigned size, unsigned count) {
-         long writepos = pos;
-         long writesize = size*count;
+   private:
+      z_stream z;
+      gz_header header;
+      std::vector<uint8_t> buffer;
+   };
 
-         pos += writesize;
-         ensureSize();
+#ifdef HAVE_LIBDEFLATE
+   /* libdeflate only compresses whole buffers, so the raw TGA is gathered first. */
+   class LibdeflateGzWriter {
+   public:
+      LibdeflateGzWriter(int level, size_t rawSize) : level(level) {
+         raw.reserve(rawSize);
+      }
 
-         memcpy(&data[writepos], buffer, writesize);
-         return count;
+      void write(const void* data, size_t size) {
+         raw.insert(raw.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
       }
 
-      int seek(long offset, int origin) {
-         if (origin == SEEK_SET) {
-            pos = offset;
-         } else if (origin == SEEK_CUR) {
-            pos += offset;
-         } else if (origin == SEEK_END) {
-            pos = getSize() + offset;
+      std::vector<uint8_t> finish() {
+         libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+         if (compressor == nullptr) {
+            fprintf(stderr, "Failed to allocate libdeflate compressor!\n");
+            exit(EXIT_FAILURE);
          }
 
-         if (pos < 0) {
-            pos = 0;
+         std::vector<uint8_t> buffer(libdeflate_gzip_compress_bound(compressor, raw.size()));
+         size_t size = libdeflate_gzip_compress(compressor, raw.data(), raw.size(), buffer.data(), buffer.size());
+         libdeflate_free_compressor(compressor);
+         if (size == 0) {
+            fprintf(stderr, "libdeflate compression error\n");
+            exit(EXIT_FAILURE);
          }
 
-         return 0;
+         buffer.resize(size);
+         return buffer;
       }
 
-      long tell() {
-         return pos;
-      }
+   private:
+      int level;
+      std::vector<uint8_t> raw;
    };
+#endif
+
+   /* Uncompressed true-color TGA, bottom-up, with a TGA 2.0 footer; the same file FreeImage's TARGA_DEFAULT writes. */
+   template <typename Writer>
+   std::vector<uint8_t> tgaGzCompress(FIBITMAP* bmp, int level) {
+      unsigned width = FreeImage_GetWidth(bmp);
+      unsigned height = FreeImage_GetHeight(bmp);
+      unsigned bpp = FreeImage_GetBPP(bmp);
+      unsigned rowSize = width * (bpp / 8);
+
+      uint8_t header[TgaHeaderSize] = {};
+      header[2] = 2; /* Uncompressed true-color */
+      header[12] = width & 0xFF;
+      header[13] = (width >> 8) & 0xFF;
+      header[14] = height & 0xFF;
+      header[15] = (height >> 8) & 0xFF;
+      header[16] = bpp;
+      header[17] = bpp == 32 ? 8 : 0; /* Alpha channel bits, origin bottom-left */
+
+      static const char footer[TgaFooterSize] = "\0\0\0\0\0\0\0\0TRUEVISION-XFILE.";
+
+      Writer gz(level, TgaHeaderSize + static_cast<size_t>(rowSize) * height + TgaFooterSize);
+      gz.write(header, sizeof(header));
+
+#if FI_RGBA_RED == 2
+      /* FreeImage keeps BGR(A) scanlines bottom-up, which already is the TGA layout; deflate straight from the bitmap. */
+      for (unsigned y = 0; y < height; y++) {
+         gz.write(FreeImage_GetScanLine(bmp, y), rowSize);
+      }
+#else
+      std::vector<uint8_t> row(rowSize);
+      unsigned pixelSize = bpp / 8;
+      for (unsigned y = 0; y < height; y++) {
+         const uint8_t* src = FreeImage_GetScanLine(bmp, y);
+         for (unsigned x = 0; x < rowSize; x += pixelSize) {
+            row[x + 0] = src[x + FI_RGBA_BLUE];
+            row[x + 1] = src[x + FI_RGBA_GREEN];
+            row[x + 2] = src[x + FI_RGBA_RED];
+            if (pixelSize == 4) {
+               row[x + 3] = src[x + FI_RGBA_ALPHA];
+            }
+         }
+         gz.write(row.data(), rowSize);
+      }
+#endif
 
-   /*
-   unsigned DLL_CALLCONV FiMemoryFileReadProc(void *buffer, unsigned size, unsigned count, fi_handle handle) {
-      FiMemoryFile *f = static_cast<FiMemoryFile*>(handle);
-      return f->read(buffer, size, count);
+      gz.write(footer, sizeof(footer));
+      return gz.finish();
    }
-   */
 
-   unsigned DLL_CALLCONV FiMemoryFileWriteProc(void *buffer, unsigned size, unsigned count, fi_handle handle) {
-      FiMemoryFile *f = static_cast<FiMemoryFile*>(handle);
-      return f->write(buffer, size, count);
-   }
+   /* Bump whenever the conversion output changes, so stale cache entries are never hit. */
+   constexpr unsigned CacheVersion = 2;
 
-   int DLL_CALLCONV FiMemoryFileSeekProc(fi_handle handle, long offset, int origin) {
-      FiMemoryFile *f = static_cast<FiMemoryFile*>(handle);
-      return f->seek(offset, origin);
-   }
+   bool readFile(const char* path, std::vector<uint8_t> &data) {
+      filepath_t filepath;
+      filepath_init(&filepath);
+      filepath_set(&filepath, path);
 
-   long DLL_CALLCONV FiMemoryFileTellProc(fi_handle handle) {
-      FiMemoryFile *f = static_cast<FiMemoryFile*>(handle);
-      return f->tell();
+      FILE *f_in = os_fopen(filepath.os_path, OS_MODE_READ);
+      if (f_in == nullptr) {
+         return false;
+      }
+
+      data.clear();
+      uint8_t chunk[16*1024];
+      size_t read;
+      while ((read = fread(chunk, 1, sizeof(chunk), f_in)) > 0) {
+         data.insert(data.end(), chunk, chunk + read);
+      }
+
+      bool ok = !ferror(f_in);
+      os_fclose(f_in);
+      return ok;
    }
 
-   constexpr FreeImageIO FiMemoryFileIO = {
-      NULL, //FiMemoryFileReadProc,
-      FiMemoryFileWriteProc,
-      FiMemoryFileSeekProc,
-      FiMemoryFileTellProc,
-   };
+   std::string getCachePath(const TgaGzOptions &options, const std::vector<uint8_t> &source, int width, int height, int bpp) {
+      /* FNV-1a and CRC-32 over the source image, 96 bits are plenty for a local cache. */
+      uint64_t fnv = 0xcbf29ce484222325ull;
+      for (auto const &b : source) {
+         fnv = (fnv ^ b) * 0x100000001b3ull;
+      }
+      uLong crc = crc32(0L, source.data(), source.size());
 
-   std::vector<uint8_t> gzCompress(const void* data, size_t size) {
-      std::vector<uint8_t> buffer;
-      uint8_t chunk[16*1024];
+      char name[128];
+      snprintf(name, sizeof(name), "%016llx%08lx-%dx%dx%d-%c%d-v%u.tga.gz",
+               static_cast<unsigned long long>(fnv), static_cast<unsigned long>(crc),
+               width, height, bpp, options.useLibdeflate ? 'd' : 'z', options.compressionLevel, CacheVersion);
+      return options.cacheDir + OS_PATH_SEPARATOR + name;
+   }
 
-      z_stream z = {};
-      deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS | 16, 8, Z_DEFAULT_STRATEGY);
+   void writeCacheFile(const std::string &cachePath, const std::vector<uint8_t> &data) {
+      filepath_t dirpath;
+      filepath_init(&dirpath);
+      filepath_set(&dirpath, cachePath.substr(0, cachePath.find_last_of(OS_PATH_SEPARATOR)).c_str());
+      os_makedir(dirpath.os_path);
+
+      /* Write to a name private to this process and thread first, concurrent builds must never see a partial entry. */
+      char suffix[64];
+      snprintf(suffix, sizeof(suffix), ".%ld.%zx.tmp", static_cast<long>(getpid()),
+               std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+      filepath_t tmppath, outpath;
+      filepath_init(&tmppath);
+      filepath_set(&tmppath, (cachePath + suffix).c_str());
+      filepath_init(&outpath);
+      filepath_set(&outpath, cachePath.c_str());
+
+      FILE *f_out = os_fopen(tmppath.os_path, OS_MODE_WRITE);
+      if (f_out == nullptr) {
+         fprintf(stderr, "Warning: Failed to write image cache entry %s\n", cachePath.c_str());
+         return;
+      }
 
-      z.avail_in = size;
-      z.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+      bool ok = fwrite(data.data(), 1, data.size(), f_out) == data.size();
+      ok = os_fclose(f_out) == 0 && ok;
+      if (!ok || os_rename(tmppath.os_path, outpath.os_path) != 0) {
+         os_remove(tmppath.os_path);
+      }
+   }
 
-      do {
-         z.avail_out = sizeof(chunk);
-         z.next_out = static_cast<Bytef*>(chunk);
+}
 
-         int ret = deflate(&z, Z_FINISH);
-         if (ret == Z_STREAM_ERROR) {
-            deflateEnd(&z);
-            fprintf(stderr, "Zlib compression error\n");
-            exit(EXIT_FAILURE);
-         }
+bool parseImageCompression(const std::string &spec, TgaGzOptions &options) {
+   std::string level = spec;
+   bool useLibdeflate = false;
+   if (spec.compare(0, 11, "libdeflate:") == 0) {
+      level = spec.substr(11);
+      useLibdeflate = true;
+   } else if (spec.compare(0, 5, "zlib:") == 0) {
+      level = spec.substr(5);
+   }
 
-         buffer.insert(buffer.end(), chunk, static_cast<uint8_t*>(z.next_out));
-      } while (z.avail_out == 0);
+#ifndef HAVE_LIBDEFLATE
+   if (useLibdeflate) {
+      fprintf(stderr, "wuhbtool was built without libdeflate support\n");
+      return false;
+   }
+#endif
 
-      deflateEnd(&z);
-      return buffer;
+   char *end = nullptr;
+   long value = strtol(level.c_str(), &end, 10);
+   if (level.empty() || *end != '\0' || value < (useLibdeflate ? 1 : 0) || value > (useLibdeflate ? 12 : 9)) {
+      fprintf(stderr, "Invalid image compression %s, expected [zlib:]0-9 or libdeflate:1-12\n", spec.c_str());
+      return false;
    }
 
+   options.compressionLevel = static_cast<int>(value);
+   options.useLibdeflate = useLibdeflate;
+   return true;
 }
 
-FileEntry* createTgaGzFileEntry(const char* inputFile, int width, int height, int bpp, const char* filename) {
+FileEntry* createTgaGzFileEntry(const char* inputFile, int width, int height, int bpp, const char* filename, const TgaGzOptions &options) {
+   std::string cachePath;
+   if (!options.cacheDir.empty()) {
+      std::vector<uint8_t> source;
+      if (readFile(inputFile, source)) {
+         cachePath = getCachePath(options, source, width, height, bpp);
+
+         std::vector<uint8_t> cached;
+         if (readFile(cachePath.c_str(), cached) && cached.size() > 2 && cached[0] == 0x1f && cached[1] == 0x8b) {
+            printf("Using cached %s for %s\n", filename, inputFile);
+            return new BufferFileEntry(filename, std::move(cached));
+         }
+      }
+   }
+
    FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename(inputFile);
    if (fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif)) {
       fprintf(stderr, "Unknown or unsupported image format: %s\n", inputFile);
@@ -147,12 +298,17 @@ FileEntry* createTgaGzFileEntry(const char* inputFile, int width, int height, in
       return nullptr;
    }
 
-   FiMemoryFile tga;
-   FreeImage_SaveToHandle(FIF_TARGA, bmp, const_cast<FreeImageIO*>(&FiMemoryFileIO), &tga, TARGA_DEFAULT);
+#ifdef HAVE_LIBDEFLATE
+   std::vector<uint8_t> data = options.useLibdeflate ? tgaGzCompress<LibdeflateGzWriter>(bmp, options.compressionLevel)
+                                                     : tgaGzCompress<GzWriter>(bmp, options.compressionLevel);
+#else
+   std::vector<uint8_t> data = tgaGzCompress<GzWriter>(bmp, options.compressionLevel);
+#endif
    FreeImage_Unload(bmp);
-   tga.ensureSize();
 
-   std::vector<uint8_t> data = gzCompress(tga.data.data(), tga.data.size());
+   if (!cachePath.empty()) {
+      writeCacheFile(cachePath, data);
+   }
 
    return new BufferFileEntry(filename, std::move(data));
 }
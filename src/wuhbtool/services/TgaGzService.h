@@ -1,7 +1,19 @@
 #pragma once
 #include <cstdint>
+#include <string>
 #include <FreeImage.h>
+#include <zlib.h>
 
 #include "../entities/FileEntry.h"
 
-FileEntry* createTgaGzFileEntry(const char* inputFile, int width, int height, int bpp, const char* filename);
+struct TgaGzOptions {
+   /* Directory holding converted .tga.gz files keyed by source hash and conversion settings, empty to disable. */
+   std::string cacheDir;
+   /* zlib level 0-9, or 1-12 when compressing with libdeflate. */
+   int compressionLevel = Z_BEST_COMPRESSION;
+   bool useLibdeflate = false;
+};
+
+bool parseImageCompression(const std::string &spec, TgaGzOptions &options);
+
+FileEntry* createTgaGzFileEntry(const char* inputFile, int width, int height, int bpp, const char* filename, const TgaGzOptions &options);
@@ -0,0 +1,558 @@
+#include "VerifyService.h"
+#include "RomFSService.h"
+#include "../entities/OSFileEntry.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace romfs {
+
+namespace {
+
+   constexpr uint32_t DirEntrySize = 0x18;
+   constexpr uint32_t FileEntrySize = 0x20;
+   constexpr unsigned MaxReportedErrors = 100;
+
+   class MappedFile {
+   public:
+      explicit MappedFile(const char *path) {
+         filepath_t filepath;
+         filepath_init(&filepath);
+         filepath_set(&filepath, path);
+
+#ifdef _WIN32
+         file = CreateFileW(filepath.os_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+         if (file == INVALID_HANDLE_VALUE) {
+            return;
+         }
+
+         LARGE_INTEGER fileSize;
+         if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            return;
+         }
+         size = fileSize.QuadPart;
+
+         mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (mapping != NULL) {
+            data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+         }
+#else
+         fd = open(filepath.os_path, O_RDONLY);
+         if (fd < 0) {
+            return;
+         }
+
+         struct stat st;
+         if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            return;
+         }
+         size = st.st_size;
+
+         void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+         if (ptr != MAP_FAILED) {
+            data = static_cast<const uint8_t *>(ptr);
+#ifdef MADV_SEQUENTIAL
+            madvise(ptr, size, MADV_SEQUENTIAL);
+#endif
+         }
+#endif
+      }
+
+      ~MappedFile() {
+#ifdef _WIN32
+         if (data) {
+            UnmapViewOfFile(data);
+         }
+         if (mapping != NULL) {
+            CloseHandle(mapping);
+         }
+         if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+         }
+#else
+         if (data) {
+            munmap(const_cast<uint8_t *>(data), size);
+         }
+         if (fd >= 0) {
+            close(fd);
+         }
+#endif
+      }
+
+      const uint8_t *data = nullptr;
+      uint64_t size = 0;
+
+   private:
+#ifdef _WIN32
+      HANDLE file = INVALID_HANDLE_VALUE;
+      HANDLE mapping = NULL;
+#else
+      int fd = -1;
+#endif
+   };
+
+   struct Region {
+      const char *name;
+      uint64_t offset;
+      uint64_t size;
+   };
+
+   struct FileExtent {
+      uint64_t offset;
+      uint64_t size;
+      uint32_t index;
+   };
+
+   class Verifier {
+   public:
+      Verifier(const char *archivePath, const uint8_t *data, uint64_t size) : archivePath(archivePath), data(data), size(size) {
+      }
+
+      bool run(const char *contentPath, const ScanFilter &filter) {
+         if (!checkHeader() || !enumerateEntries()) {
+            return false;
+         }
+
+         checkLinks();
+         checkHashChains("Directory", dirHashTable, dirHashCount, dirEntries, dirTable, DirEntrySize);
+         checkHashChains("File", fileHashTable, fileHashCount, fileEntries, fileTable, FileEntrySize);
+         checkExtents();
+
+         if (contentPath && errors == 0) {
+            compareContent(contentPath, filter);
+         }
+
+         if (errors == 0) {
+            printf("%s: OK (%zu directories, %zu files)\n", archivePath, dirEntries.size(), fileEntries.size());
+         } else {
+            fprintf(stderr, "%s: %u error(s)\n", archivePath, errors.load());
+         }
+         return errors == 0;
+      }
+
+   private:
+      void error(const char *format, ...) {
+         std::lock_guard<std::mutex> lock(errorMutex);
+         if (++errors > MaxReportedErrors) {
+            return;
+         }
+
+         va_list args;
+         va_start(args, format);
+         fprintf(stderr, "%s: ", archivePath);
+         vfprintf(stderr, format, args);
+         fprintf(stderr, "\n");
+         va_end(args);
+      }
+
+      bool checkHeader() {
+         romfs_header_t header;
+         if (size < sizeof(header)) {
+            error("File is too small for a header");
+            return false;
+         }
+         memcpy(&header, data, sizeof(header));
+
+         if (memcmp(&header.header_magic, "WUHB", sizeof(header.header_magic)) != 0) {
+            error("Invalid magic");
+            return false;
+         }
+
+         if (be_word(header.header_size) != sizeof(header)) {
+            error("Unexpected header size 0x%X", be_word(header.header_size));
+            return false;
+         }
+
+         Region regions[] = {
+            {"dir_hash_table", be_dword(header.dir_hash_table_ofs), be_dword(header.dir_hash_table_size)},
+            {"dir_table", be_dword(header.dir_table_ofs), be_dword(header.dir_table_size)},
+            {"file_hash_table", be_dword(header.file_hash_table_ofs), be_dword(header.file_hash_table_size)},
+            {"file_table", be_dword(header.file_table_ofs), be_dword(header.file_table_size)},
+         };
+
+         partitionOffset = be_dword(header.file_partition_ofs);
+         uint64_t partitionEnd = size;
+         for (auto const &r : regions) {
+            if (r.offset > size || r.size > size - r.offset) {
+               error("%s (0x%llX + 0x%llX) exceeds the file size 0x%llX", r.name,
+                     static_cast<unsigned long long>(r.offset), static_cast<unsigned long long>(r.size), static_cast<unsigned long long>(size));
+               return false;
+            }
+            partitionEnd = std::min(partitionEnd, r.offset);
+         }
+
+         for (auto const &a : regions) {
+            for (auto const &b : regions) {
+               if (&a < &b && a.offset < b.offset + b.size && b.offset < a.offset + a.size) {
+                  error("%s overlaps %s", a.name, b.name);
+                  return false;
+               }
+            }
+         }
+
+         if (partitionOffset < sizeof(header) || partitionOffset > partitionEnd) {
+            error("File partition offset 0x%llX is outside of 0x%zX-0x%llX", static_cast<unsigned long long>(partitionOffset),
+                  sizeof(header), static_cast<unsigned long long>(partitionEnd));
+            return false;
+         }
+         partitionSize = partitionEnd - partitionOffset;
+
+         if (regions[0].size == 0 || regions[0].size % 4 != 0 || regions[2].size == 0 || regions[2].size % 4 != 0) {
+            error("Hash table sizes must be non-zero multiples of 4");
+            return false;
+         }
+
+         if (regions[1].size < DirEntrySize) {
+            error("Directory table has no root entry");
+            return false;
+         }
+
+         dirHashTable = reinterpret_cast<const uint32_t *>(data + regions[0].offset);
+         dirHashCount = regions[0].size / 4;
+         dirTable = data + regions[1].offset;
+         dirTableSize = regions[1].size;
+         fileHashTable = reinterpret_cast<const uint32_t *>(data + regions[2].offset);
+         fileHashCount = regions[2].size / 4;
+         fileTable = data + regions[3].offset;
+         fileTableSize = regions[3].size;
+         return true;
+      }
+
+      /* The tables are packed, so walking them front to back yields every entry exactly once. */
+      bool enumerateTable(const char *name, const uint8_t *table, uint64_t tableSize, uint32_t entrySize, std::vector<uint32_t> &entries) {
+         uint64_t ofs = 0;
+         while (ofs < tableSize) {
+            /* CreateArchive() accounts for the root directory twice, leaving zeroed slack behind the last entry. */
+            if (ofs != 0 && std::all_of(table + ofs, table + tableSize, [](uint8_t b) { return b == 0; })) {
+               break;
+            }
+
+            if (tableSize - ofs < entrySize) {
+               error("%s table entry at 0x%llX is truncated", name, static_cast<unsigned long long>(ofs));
+               return false;
+            }
+
+            uint32_t nameSize = be_word(*reinterpret_cast<const uint32_t *>(table + ofs + entrySize - 4));
+            uint64_t next = ofs + entrySize + align<uint64_t>(nameSize, 4);
+            if (next > tableSize) {
+               error("%s table entry at 0x%llX has a name running past the table", name, static_cast<unsigned long long>(ofs));
+               return false;
+            }
+
+            entries.push_back(static_cast<uint32_t>(ofs));
+            ofs = next;
+         }
+         return true;
+      }
+
+      bool enumerateEntries() {
+         return enumerateTable("Directory", dirTable, dirTableSize, DirEntrySize, dirEntries)
+                && enumerateTable("File", fileTable, fileTableSize, FileEntrySize, fileEntries);
+      }
+
+      static int64_t indexOf(const std::vector<uint32_t> &entries, uint32_t ofs) {
+         auto it = std::lower_bound(entries.begin(), entries.end(), ofs);
+         if (it == entries.end() || *it != ofs) {
+            return -1;
+         }
+         return it - entries.begin();
+      }
+
+      const romfs_direntry_t *dir(uint32_t index) const {
+         return reinterpret_cast<const romfs_direntry_t *>(dirTable + dirEntries[index]);
+      }
+
+      const romfs_fentry_t *file(uint32_t index) const {
+         return reinterpret_cast<const romfs_fentry_t *>(fileTable + fileEntries[index]);
+      }
+
+      void checkLinks() {
+         std::vector<bool> dirVisited(dirEntries.size());
+         std::vector<bool> fileVisited(fileEntries.size());
+         std::vector<uint32_t> stack;
+
+         dirPaths.assign(dirEntries.size(), std::string());
+         filePaths.assign(fileEntries.size(), std::string());
+
+         if (be_word(dir(0)->parent) != 0) {
+            error("Root directory's parent doesn't point to itself");
+         }
+         if (be_word(dir(0)->sibling) != ROMFS_ENTRY_EMPTY) {
+            error("Root directory has a sibling");
+         }
+
+         dirPaths[0] = OS_PATH_SEPARATOR;
+         dirVisited[0] = true;
+         stack.push_back(0);
+
+         while (!stack.empty()) {
+            uint32_t cur = stack.back();
+            stack.pop_back();
+
+            for (uint32_t ofs = be_word(dir(cur)->child); ofs != ROMFS_ENTRY_EMPTY; ) {
+               int64_t idx = indexOf(dirEntries, ofs);
+               if (idx < 0) {
+                  error("%s: child link 0x%X is not a directory entry", dirPaths[cur].c_str(), ofs);
+                  break;
+               }
+               if (dirVisited[idx]) {
+                  error("%s: directory 0x%X is linked more than once", dirPaths[cur].c_str(), ofs);
+                  break;
+               }
+               dirVisited[idx] = true;
+
+               const romfs_direntry_t *entry = dir(idx);
+               dirPaths[idx] = dirPaths[cur] + std::string(entry->name, be_word(entry->name_size)) + OS_PATH_SEPARATOR;
+               if (be_word(entry->parent) != dirEntries[cur]) {
+                  error("%s: parent link 0x%X should be 0x%X", dirPaths[idx].c_str(), be_word(entry->parent), dirEntries[cur]);
+               }
+
+               stack.push_back(idx);
+               ofs = be_word(entry->sibling);
+            }
+
+            for (uint32_t ofs = be_word(dir(cur)->file); ofs != ROMFS_ENTRY_EMPTY; ) {
+               int64_t idx = indexOf(fileEntries, ofs);
+               if (idx < 0) {
+                  error("%s: file link 0x%X is not a file entry", dirPaths[cur].c_str(), ofs);
+                  break;
+               }
+               if (fileVisited[idx]) {
+                  error("%s: file 0x%X is linked more than once", dirPaths[cur].c_str(), ofs);
+                  break;
+               }
+               fileVisited[idx] = true;
+
+               const romfs_fentry_t *entry = file(idx);
+               filePaths[idx] = dirPaths[cur] + std::string(entry->name, be_word(entry->name_size));
+               if (be_word(entry->parent) != dirEntries[cur]) {
+                  error("%s: parent link 0x%X should be 0x%X", filePaths[idx].c_str(), be_word(entry->parent), dirEntries[cur]);
+               }
+
+               ofs = be_word(entry->sibling);
+            }
+         }
+
+         for (size_t i = 0; i < dirEntries.size(); i++) {
+            if (!dirVisited[i]) {
+               error("Directory entry 0x%X is not reachable from the root", dirEntries[i]);
+            }
+         }
+         for (size_t i = 0; i < fileEntries.size(); i++) {
+            if (!fileVisited[i]) {
+               error("File entry 0x%X is not reachable from the root", fileEntries[i]);
+            }
+         }
+      }
+
+      /* Walks every bucket once; each entry must sit in exactly one chain, the one its path hash selects. */
+      void checkHashChains(const char *name, const uint32_t *hashTable, uint32_t bucketCount,
+                           const std::vector<uint32_t> &entries, const uint8_t *table, uint32_t entrySize) {
+         std::vector<bool> seen(entries.size());
+
+         for (uint32_t bucket = 0; bucket < bucketCount; bucket++) {
+            for (uint32_t ofs = be_word(hashTable[bucket]); ofs != ROMFS_ENTRY_EMPTY; ) {
+               int64_t idx = indexOf(entries, ofs);
+               if (idx < 0) {
+                  error("%s hash bucket %u links to 0x%X, which is not an entry", name, bucket, ofs);
+                  break;
+               }
+               if (seen[idx]) {
+                  error("%s entry 0x%X is linked twice in the hash table", name, ofs);
+                  break;
+               }
+               seen[idx] = true;
+
+               /* parent and hash/name_size sit at the start and end of both entry headers. */
+               const uint8_t *entry = table + ofs;
+               uint32_t parent = be_word(*reinterpret_cast<const uint32_t *>(entry));
+               uint32_t nameSize = be_word(*reinterpret_cast<const uint32_t *>(entry + entrySize - 4));
+               uint32_t hash = CalcPathHash(parent, entry + entrySize, 0, nameSize);
+               if (hash % bucketCount != bucket) {
+                  error("%s entry 0x%X is chained in bucket %u but hashes to bucket %u", name, ofs, bucket, hash % bucketCount);
+               }
+
+               ofs = be_word(*reinterpret_cast<const uint32_t *>(entry + entrySize - 8));
+            }
+         }
+
+         for (size_t i = 0; i < entries.size(); i++) {
+            if (!seen[i]) {
+               error("%s entry 0x%X is missing from the hash table", name, entries[i]);
+            }
+         }
+      }
+
+      /* Extents may only overlap when two entries share the exact same data. */
+      void checkExtents() {
+         std::vector<FileExtent> extents;
+         extents.reserve(fileEntries.size());
+
+         for (uint32_t i = 0; i < fileEntries.size(); i++) {
+            uint64_t offset = be_dword(file(i)->offset);
+            uint64_t fileSize = be_dword(file(i)->size);
+            if (offset > partitionSize || fileSize > partitionSize - offset) {
+               error("%s: data (0x%llX + 0x%llX) exceeds the file partition", filePaths[i].c_str(),
+                     static_cast<unsigned long long>(offset), static_cast<unsigned long long>(fileSize));
+               continue;
+            }
+            if (fileSize != 0) {
+               extents.push_back({offset, fileSize, i});
+            }
+         }
+
+         std::sort(extents.begin(), extents.end(), [](const FileExtent &a, const FileExtent &b) {
+            return a.offset < b.offset || (a.offset == b.offset && a.size < b.size);
+         });
+
+         const FileExtent *last = nullptr;
+         for (auto const &e : extents) {
+            if (last && e.offset < last->offset + last->size && !(e.offset == last->offset && e.size == last->size)) {
+               error("%s overlaps %s", filePaths[e.index].c_str(), filePaths[last->index].c_str());
+            }
+            if (!last || e.offset + e.size > last->offset + last->size) {
+               last = &e;
+            }
+         }
+      }
+
+      void compareContent(const char *contentPath, const ScanFilter &filter) {
+         filepath_t dirpath;
+         filepath_init(&dirpath);
+         filepath_set(&dirpath, contentPath);
+
+         DirectoryEntry *source = CreateFolderFromPath(dirpath, "content", filter);
+         std::vector<FileEntry *> sourceFiles;
+         source->collectFiles(sourceFiles);
+
+         std::unordered_map<std::string, uint32_t> archiveFiles;
+         std::string prefix = std::string(OS_PATH_SEPARATOR) + "content" + OS_PATH_SEPARATOR;
+         for (uint32_t i = 0; i < fileEntries.size(); i++) {
+            if (filePaths[i].compare(0, prefix.size(), prefix) == 0) {
+               archiveFiles.emplace(filePaths[i], i);
+            }
+         }
+
+         std::vector<std::pair<OSFileEntry *, uint32_t>> pairs;
+         for (auto const &f : sourceFiles) {
+            auto it = archiveFiles.find(f->getFullPath());
+            if (it == archiveFiles.end()) {
+               error("%s is missing from the archive", f->getFullPath().c_str());
+               continue;
+            }
+            if (be_dword(file(it->second)->size) != f->size) {
+               error("%s has size 0x%llX, the source has 0x%llX", it->first.c_str(),
+                     static_cast<unsigned long long>(be_dword(file(it->second)->size)), static_cast<unsigned long long>(f->size));
+            } else {
+               pairs.emplace_back(static_cast<OSFileEntry *>(f), it->second);
+            }
+            archiveFiles.erase(it);
+         }
+
+         for (auto const &f : archiveFiles) {
+            error("%s is not part of the source tree", f.first.c_str());
+         }
+
+         std::atomic<size_t> next(0);
+         auto worker = [&]() {
+            std::vector<uint8_t> buffer(0x400000);
+            for (size_t i; (i = next++) < pairs.size(); ) {
+               compareFile(pairs[i].first, pairs[i].second, buffer);
+            }
+         };
+
+         std::vector<std::thread> threads;
+         unsigned threadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+         for (unsigned i = 1; i < threadCount; i++) {
+            threads.emplace_back(worker);
+         }
+         worker();
+         for (auto &t : threads) {
+            t.join();
+         }
+
+         delete source;
+      }
+
+      void compareFile(OSFileEntry *source, uint32_t index, std::vector<uint8_t> &buffer) {
+         FILE *f_in = os_fopen(source->getOSPath().os_path, OS_MODE_READ);
+         if (f_in == nullptr) {
+            error("Failed to open %s", source->getOSPath().char_path);
+            return;
+         }
+
+         const uint8_t *archived = data + partitionOffset + be_dword(file(index)->offset);
+         uint64_t offset = 0;
+         while (offset < source->size) {
+            size_t read_size = static_cast<size_t>(std::min<uint64_t>(buffer.size(), source->size - offset));
+            if (fread(buffer.data(), 1, read_size, f_in) != read_size) {
+               error("Failed to read from %s", source->getOSPath().char_path);
+               break;
+            }
+            if (memcmp(buffer.data(), archived + offset, read_size) != 0) {
+               error("%s differs from %s", filePaths[index].c_str(), source->getOSPath().char_path);
+               break;
+            }
+            offset += read_size;
+         }
+
+         os_fclose(f_in);
+      }
+
+      const char *archivePath;
+      const uint8_t *data;
+      uint64_t size;
+
+      uint64_t partitionOffset = 0;
+      uint64_t partitionSize = 0;
+      const uint32_t *dirHashTable = nullptr;
+      uint32_t dirHashCount = 0;
+      const uint8_t *dirTable = nullptr;
+      uint64_t dirTableSize = 0;
+      const uint32_t *fileHashTable = nullptr;
+      uint32_t fileHashCount = 0;
+      const uint8_t *fileTable = nullptr;
+      uint64_t fileTableSize = 0;
+
+      std::vector<uint32_t> dirEntries;
+      std::vector<uint32_t> fileEntries;
+      std::vector<std::string> dirPaths;
+      std::vector<std::string> filePaths;
+
+      std::mutex errorMutex;
+      std::atomic<unsigned> errors{0};
+   };
+
+}
+
+bool VerifyArchive(const char *archivePath, const char *contentPath, const ScanFilter &filter) {
+   MappedFile archive(archivePath);
+   if (archive.data == nullptr) {
+      fprintf(stderr, "Failed to map %s!\n", archivePath);
+      return false;
+   }
+
+   Verifier verifier(archivePath, archive.data, archive.size);
+   return verifier.run(contentPath, filter);
+}
+
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "RomFSService.h"
+
+namespace romfs {
+
+   /* Checks the header, table links, hash chains and file extents of a WUHB, optionally comparing /content against contentPath.
+    * The filter has to be the one the archive was built with, or filtered files are reported missing. */
+   bool VerifyArchive(const char *archivePath, const char *contentPath, const ScanFilter &filter = ScanFilter());
+
+}
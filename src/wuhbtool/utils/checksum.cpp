@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "checksum.h"
+
+namespace {
+    /* CRC-32C (Castagnoli), reflected polynomial; slicing-by-8 tables built on first use. */
+    struct Crc32cTables {
+        uint32_t table[8][256];
+
+        Crc32cTables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++) {
+                    crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+                }
+                table[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int t = 1; t < 8; t++) {
+                    table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+
+    uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t size) {
+#ifdef __SSE4_2__
+        while (size >= 8) {
+            uint64_t v;
+            memcpy(&v, data, 8);
+            crc = static_cast<uint32_t>(_mm_crc32_u64(crc, v));
+            data += 8;
+            size -= 8;
+        }
+        while (size--) {
+            crc = _mm_crc32_u8(crc, *data++);
+        }
+        return crc;
+#else
+        static const Crc32cTables tables;
+        auto const &t = tables.table;
+
+        while (size >= 8) {
+            uint32_t lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24));
+            uint32_t hi = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<uint32_t>(data[7]) << 24);
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+            data += 8;
+            size -= 8;
+        }
+        while (size--) {
+            crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+        }
+        return crc;
+#endif
+    }
+
+    const uint32_t sha256K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    inline uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    std::string to_hex(const uint8_t *digest, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(size * 2, '0');
+        for (size_t i = 0; i < size; i++) {
+            hex[i * 2] = digits[digest[i] >> 4];
+            hex[i * 2 + 1] = digits[digest[i] & 0xF];
+        }
+        return hex;
+    }
+}
+
+bool checksum_parse_type(const std::string &name, ChecksumType *type) {
+    if (name == "crc32c") {
+        *type = ChecksumType::CRC32C;
+    } else if (name == "sha256") {
+        *type = ChecksumType::SHA256;
+    } else if (name == "xxh3") {
+#ifdef HAVE_LIBXXHASH
+        *type = ChecksumType::XXH3;
+#else
+        fprintf(stderr, "wuhbtool was built without xxHash support\n");
+        return false;
+#endif
+    } else {
+        fprintf(stderr, "Unknown checksum type %s, expected crc32c, xxh3 or sha256\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+const char *checksum_type_name(ChecksumType type) {
+    switch (type) {
+        case ChecksumType::CRC32C:
+            return "crc32c";
+        case ChecksumType::XXH3:
+            return "xxh3";
+        case ChecksumType::SHA256:
+        default:
+            return "sha256";
+    }
+}
+
+Checksum::Checksum(ChecksumType type) : type(type) {
+    static const uint32_t sha256Init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sha256State, sha256Init, sizeof(sha256State));
+
+#ifdef HAVE_LIBXXHASH
+    if (type == ChecksumType::XXH3) {
+        xxh3State = XXH3_createState();
+        XXH3_64bits_reset(xxh3State);
+    }
+#endif
+}
+
+Checksum::~Checksum() {
+#ifdef HAVE_LIBXXHASH
+    if (xxh3State) {
+        XXH3_freeState(xxh3State);
+    }
+#endif
+}
+
+void Checksum::update(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+
+    switch (type) {
+        case ChecksumType::CRC32C:
+            crc = crc32c_update(crc, bytes, size);
+            break;
+        case ChecksumType::XXH3:
+#ifdef HAVE_LIBXXHASH
+            XXH3_64bits_update(xxh3State, bytes, size);
+#endif
+            break;
+        case ChecksumType::SHA256:
+            sha256Length += size;
+            if (sha256Buffered) {
+                size_t fill = sizeof(sha256Buffer) - sha256Buffered;
+                if (size < fill) {
+                    memcpy(sha256Buffer + sha256Buffered, bytes, size);
+                    sha256Buffered += size;
+                    return;
+                }
+                memcpy(sha256Buffer + sha256Buffered, bytes, fill);
+                sha256Block(sha256Buffer);
+                sha256Buffered = 0;
+                bytes += fill;
+                size -= fill;
+            }
+            for (; size >= 64; bytes += 64, size -= 64) {
+                sha256Block(bytes);
+            }
+            memcpy(sha256Buffer, bytes, size);
+            sha256Buffered = size;
+            break;
+    }
+}
+
+std::string Checksum::finish() {
+    switch (type) {
+        case ChecksumType::CRC32C: {
+            uint32_t value = ~crc;
+            uint8_t digest[4] = {
+                static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+                static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value),
+            };
+            return to_hex(digest, sizeof(digest));
+        }
+        case ChecksumType::XXH3: {
+#ifdef HAVE_LIBXXHASH
+            XXH64_hash_t value = XXH3_64bits_digest(xxh3State);
+            uint8_t digest[8];
+            for (int i = 0; i < 8; i++) {
+                digest[i] = static_cast<uint8_t>(value >> (56 - i * 8));
+            }
+            return to_hex(digest, sizeof(digest));
+#else
+            return "";
+#endif
+        }
+        case ChecksumType::SHA256:
+        default: {
+            uint64_t bits = sha256Length * 8;
+            uint8_t padding[72] = {0x80};
+            size_t padSize = (sha256Buffered < 56 ? 56 : 120) - sha256Buffered;
+            for (int i = 0; i < 8; i++) {
+                padding[padSize + i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+            }
+            update(padding, padSize + 8);
+
+            uint8_t digest[32];
+            for (int i = 0; i < 8; i++) {
+                digest[i * 4] = static_cast<uint8_t>(sha256State[i] >> 24);
+                digest[i * 4 + 1] = static_cast<uint8_t>(sha256State[i] >> 16);
+                digest[i * 4 + 2] = static_cast<uint8_t>(sha256State[i] >> 8);
+                digest[i * 4 + 3] = static_cast<uint8_t>(sha256State[i]);
+            }
+            return to_hex(digest, sizeof(digest));
+        }
+    }
+}
+
+void Checksum::sha256Block(const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha256State[0], b = sha256State[1], c = sha256State[2], d = sha256State[3];
+    uint32_t e = sha256State[4], f = sha256State[5], g = sha256State[6], h = sha256State[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha256State[0] += a;
+    sha256State[1] += b;
+    sha256State[2] += c;
+    sha256State[3] += d;
+    sha256State[4] += e;
+    sha256State[5] += f;
+    sha256State[6] += g;
+    sha256State[7] += h;
+}
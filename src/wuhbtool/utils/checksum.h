@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef HAVE_LIBXXHASH
+#include <xxhash.h>
+#endif
+
+enum class ChecksumType {
+    CRC32C,
+    XXH3,
+    SHA256,
+};
+
+bool checksum_parse_type(const std::string &name, ChecksumType *type);
+const char *checksum_type_name(ChecksumType type);
+
+/* Incremental hash of a data stream, finish() returns the digest as lowercase hex. */
+class Checksum {
+public:
+    explicit Checksum(ChecksumType type);
+    ~Checksum();
+
+    Checksum(const Checksum &) = delete;
+    Checksum &operator=(const Checksum &) = delete;
+
+    void update(const void *data, size_t size);
+
+    std::string finish();
+
+private:
+    void sha256Block(const uint8_t *block);
+
+    ChecksumType type;
+
+    uint32_t crc = 0xFFFFFFFF;
+
+    uint32_t sha256State[8];
+    uint8_t sha256Buffer[64];
+    size_t sha256Buffered = 0;
+    uint64_t sha256Length = 0;
+
+#ifdef HAVE_LIBXXHASH
+    XXH3_state_t *xxh3State = nullptr;
+#endif
+};
@@ -32,6 +32,8 @@ typedef struct _stati64 os_stat64_t;
 #define os_readdir _wreaddir
 #define os_stat _wstati64
 #define os_fclose fclose
+#define os_rename _wrename
+#define os_remove _wremove
 
 #define OS_MODE_READ L"rb"
 #define OS_MODE_WRITE L"wb"
@@ -48,6 +50,8 @@ typedef struct stat os_stat64_t;
 #define os_readdir readdir
 #define os_stat stat
 #define os_fclose fclose
+#define os_rename rename
+#define os_remove remove
 
 #define OS_MODE_READ "rb"
 #define OS_MODE_WRITE "wb"
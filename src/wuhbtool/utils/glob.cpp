@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "glob.h"
+
+GlobPattern::GlobPattern(const std::string &pattern) : pattern(pattern) {
+    std::string p = pattern;
+    if (p.size() > 1 && p.back() == '/') {
+        directoryOnly = true;
+        p.pop_back();
+    }
+    if (p.find('/') != std::string::npos) {
+        anchored = true;
+        if (p[0] == '/') {
+            p.erase(0, 1);
+        }
+    }
+
+    for (size_t i = 0; i < p.size(); i++) {
+        char c = p[i];
+        if (c == '*') {
+            if (i + 1 < p.size() && p[i + 1] == '*') {
+                i++;
+                if (i + 1 < p.size() && p[i + 1] == '/') {
+                    i++;
+                    tokens.push_back({TokenType::DoubleStarSlash});
+                } else {
+                    tokens.push_back({TokenType::DoubleStar});
+                }
+            } else {
+                tokens.push_back({TokenType::Star});
+            }
+        } else if (c == '?') {
+            tokens.push_back({TokenType::AnyChar});
+        } else if (c == '[' && p.find(']', i + 2) != std::string::npos) {
+            Token token{TokenType::CharClass};
+            size_t j = i + 1;
+            if (p[j] == '!' || p[j] == '^') {
+                token.negated = true;
+                j++;
+            }
+            /* A ']' right after the opening bracket is a member, not the end. */
+            for (bool first = true; j < p.size() && (first || p[j] != ']'); j++, first = false) {
+                char lo = p[j], hi = p[j];
+                if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']') {
+                    hi = p[j + 2];
+                    j += 2;
+                }
+                token.chars += lo;
+                token.chars += hi;
+            }
+            if (j >= p.size()) {
+                /* Unterminated, take the '[' literally. */
+                tokens.push_back({TokenType::Literal, "["});
+                continue;
+            }
+            tokens.push_back(token);
+            i = j;
+        } else {
+            if (c == '\\' && i + 1 < p.size()) {
+                c = p[++i];
+            }
+            if (!tokens.empty() && tokens.back().type == TokenType::Literal) {
+                tokens.back().chars += c;
+            } else {
+                tokens.push_back({TokenType::Literal, std::string(1, c)});
+            }
+        }
+    }
+}
+
+bool GlobPattern::matches(const std::string &path, bool isDirectory) const {
+    if (directoryOnly && !isDirectory) {
+        return false;
+    }
+
+    const char *str = path.c_str();
+    const char *end = str + path.size();
+    if (!anchored) {
+        const char *slash = strrchr(str, '/');
+        if (slash) {
+            str = slash + 1;
+        }
+    }
+    return matchTokens(0, str, end);
+}
+
+bool GlobPattern::matchTokens(size_t token, const char *str, const char *end) const {
+    for (; token < tokens.size(); token++) {
+        const Token &t = tokens[token];
+        switch (t.type) {
+            case TokenType::Literal:
+                if (static_cast<size_t>(end - str) < t.chars.size() || memcmp(str, t.chars.data(), t.chars.size()) != 0) {
+                    return false;
+                }
+                str += t.chars.size();
+                break;
+            case TokenType::AnyChar:
+                if (str == end || *str == '/') {
+                    return false;
+                }
+                str++;
+                break;
+            case TokenType::CharClass: {
+                if (str == end || *str == '/') {
+                    return false;
+                }
+                bool member = false;
+                for (size_t i = 0; i < t.chars.size(); i += 2) {
+                    if (*str >= t.chars[i] && *str <= t.chars[i + 1]) {
+                        member = true;
+                        break;
+                    }
+                }
+                if (member == t.negated) {
+                    return false;
+                }
+                str++;
+                break;
+            }
+            case TokenType::Star:
+                /* Try every split within the current path component. */
+                for (const char *s = str;; s++) {
+                    if (matchTokens(token + 1, s, end)) {
+                        return true;
+                    }
+                    if (s == end || *s == '/') {
+                        return false;
+                    }
+                }
+            case TokenType::DoubleStar:
+                for (const char *s = str;; s++) {
+                    if (matchTokens(token + 1, s, end)) {
+                        return true;
+                    }
+                    if (s == end) {
+                        return false;
+                    }
+                }
+            case TokenType::DoubleStarSlash:
+                /* Zero or more whole directories. */
+                for (const char *s = str;;) {
+                    if (matchTokens(token + 1, s, end)) {
+                        return true;
+                    }
+                    s = static_cast<const char *>(memchr(s, '/', end - s));
+                    if (s == nullptr) {
+                        return false;
+                    }
+                    s++;
+                }
+        }
+    }
+    return str == end;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Shell-style glob compiled once and matched against '/'-separated relative paths.
+ * '*', '?' and [...] never match '/', '**' matches across directories. A pattern
+ * without a '/' matches the last path component at any depth, a trailing '/' makes
+ * it match directories only.
+ */
+class GlobPattern {
+public:
+    explicit GlobPattern(const std::string &pattern);
+
+    bool matches(const std::string &path, bool isDirectory) const;
+
+    const std::string &getPattern() const {
+        return pattern;
+    }
+
+private:
+    enum class TokenType {
+        Literal,
+        AnyChar,
+        Star,
+        DoubleStar,
+        DoubleStarSlash,
+        CharClass,
+    };
+
+    struct Token {
+        TokenType type;
+        std::string chars; /* Literal text, or the ranges of a CharClass as pairs of bytes. */
+        bool negated = false;
+    };
+
+    bool matchTokens(size_t token, const char *str, const char *end) const;
+
+    std::string pattern;
+    std::vector<Token> tokens;
+    bool anchored = false;
+    bool directoryOnly = false;
+};
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "hashpool.h"
+
+HashStream::HashStream(HashPool &pool, ChecksumType type) : pool(pool), checksum(type) {
+}
+
+unsigned char *HashStream::buffer() {
+    flush();
+    current = pool.acquire();
+    return current;
+}
+
+void HashStream::commit(size_t size) {
+    filled = size;
+    flush();
+}
+
+void HashStream::update(const void *data, size_t size) {
+    auto *bytes = static_cast<const unsigned char *>(data);
+    while (size > 0) {
+        if (current == nullptr) {
+            current = pool.acquire();
+            filled = 0;
+        }
+        size_t n = std::min(size, HashPool::BufferSize - filled);
+        memcpy(current + filled, bytes, n);
+        filled += n;
+        bytes += n;
+        size -= n;
+        if (filled == HashPool::BufferSize) {
+            flush();
+        }
+    }
+}
+
+void HashStream::close() {
+    flush();
+    pool.submit(this, Chunk{nullptr, 0, true});
+}
+
+void HashStream::flush() {
+    if (current != nullptr) {
+        pool.submit(this, Chunk{current, filled, false});
+        current = nullptr;
+        filled = 0;
+    }
+}
+
+HashPool::HashPool(ChecksumType type) : type(type) {
+    unsigned threadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+    /* Two buffers per worker keep every thread busy while the writer fills the next ones. */
+    maxBuffers = threadCount * 2 + 2;
+    for (unsigned i = 0; i < threadCount; i++) {
+        threads.emplace_back(&HashPool::worker, this);
+    }
+}
+
+HashPool::~HashPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    workReady.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto *buffer : freeBuffers) {
+        free(buffer);
+    }
+}
+
+HashStream *HashPool::open() {
+    streams.emplace_back(new HashStream(*this, type));
+    return streams.back().get();
+}
+
+void HashPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return queuedChunks == 0; });
+}
+
+unsigned char *HashPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (freeBuffers.empty() && allocatedBuffers < maxBuffers) {
+        auto *buffer = static_cast<unsigned char *>(malloc(BufferSize));
+        if (buffer == nullptr) {
+            fprintf(stderr, "Failed to allocate hash buffer!\n");
+            exit(EXIT_FAILURE);
+        }
+        allocatedBuffers++;
+        return buffer;
+    }
+    bufferFree.wait(lock, [this]() { return !freeBuffers.empty(); });
+    unsigned char *buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return buffer;
+}
+
+void HashPool::submit(HashStream *stream, const HashStream::Chunk &chunk) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream->pending.push_back(chunk);
+        queuedChunks++;
+        if (stream->scheduled) {
+            /* The worker that owns the stream picks the chunk up before letting go of it. */
+            return;
+        }
+        stream->scheduled = true;
+        ready.push_back(stream);
+    }
+    workReady.notify_one();
+}
+
+void HashPool::worker() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        workReady.wait(lock, [this]() { return stopping || !ready.empty(); });
+        if (ready.empty()) {
+            return;
+        }
+        HashStream *stream = ready.front();
+        ready.pop_front();
+
+        /* A stream is only ever on one worker, which keeps its chunks in order. */
+        while (!stream->pending.empty()) {
+            HashStream::Chunk chunk = stream->pending.front();
+            stream->pending.pop_front();
+            lock.unlock();
+
+            if (chunk.last) {
+                stream->result = stream->checksum.finish();
+            } else {
+                stream->checksum.update(chunk.data, chunk.size);
+            }
+
+            lock.lock();
+            if (chunk.data != nullptr) {
+                freeBuffers.push_back(chunk.data);
+                bufferFree.notify_one();
+            }
+            if (--queuedChunks == 0) {
+                idle.notify_all();
+            }
+        }
+        stream->scheduled = false;
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checksum.h"
+
+class HashPool;
+
+/* Data of one file on its way to the pool, chunks are hashed in the order they were committed. */
+class HashStream {
+public:
+    HashStream(const HashStream &) = delete;
+    HashStream &operator=(const HashStream &) = delete;
+
+    /* An empty buffer of HashPool::BufferSize bytes, hand the filled part back with commit(). */
+    unsigned char *buffer();
+
+    void commit(size_t size);
+
+    /* Copies the data into pool buffers, for writers that don't read into buffer() themselves. */
+    void update(const void *data, size_t size);
+
+    /* No more data follows, the digest is ready after HashPool::wait(). */
+    void close();
+
+    const std::string &digest() const {
+        return result;
+    }
+
+private:
+    friend class HashPool;
+
+    struct Chunk {
+        unsigned char *data;
+        size_t size;
+        bool last;
+    };
+
+    HashStream(HashPool &pool, ChecksumType type);
+
+    void flush();
+
+    HashPool &pool;
+    Checksum checksum;
+    std::string result;
+
+    unsigned char *current = nullptr;
+    size_t filled = 0;
+
+    /* Guarded by the pool mutex. */
+    std::deque<Chunk> pending;
+    bool scheduled = false;
+};
+
+/* Persistent worker threads hashing files in parallel while the writer keeps copying. */
+class HashPool {
+public:
+    static const size_t BufferSize = 0x400000;
+
+    explicit HashPool(ChecksumType type);
+    ~HashPool();
+
+    HashPool(const HashPool &) = delete;
+    HashPool &operator=(const HashPool &) = delete;
+
+    /* A stream for the next file, owned by the pool. */
+    HashStream *open();
+
+    /* Blocks until every committed chunk is hashed and every closed stream has its digest. */
+    void wait();
+
+private:
+    friend class HashStream;
+
+    unsigned char *acquire();
+    void submit(HashStream *stream, const HashStream::Chunk &chunk);
+    void worker();
+
+    ChecksumType type;
+    std::vector<std::unique_ptr<HashStream>> streams;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable bufferFree;
+    std::condition_variable idle;
+    std::deque<HashStream *> ready;
+    std::vector<unsigned char *> freeBuffers;
+    size_t allocatedBuffers = 0;
+    size_t maxBuffers;
+    size_t queuedChunks = 0;
+    bool stopping = false;
+};
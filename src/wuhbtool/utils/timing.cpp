@@ -0,0 +1,42 @@
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "timing.h"
+
+PhaseTimer::PhaseTimer(bool enabled) : enabled(enabled) {
+    start = last = clock::now();
+}
+
+void PhaseTimer::lap(const char *phase) {
+    if (!enabled) {
+        return;
+    }
+
+    clock::time_point now = clock::now();
+    printf("Timing: %-12s %9.3f s\n", phase, std::chrono::duration<double>(now - last).count());
+    last = now;
+}
+
+double PhaseTimer::elapsed() const {
+    return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+uint64_t get_peak_rss() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    /* Kilobytes on Linux and the BSDs. */
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
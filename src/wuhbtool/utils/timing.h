@@ -0,0 +1,28 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+/* Wall clock timer for --timings, each lap() prints the time since the previous one. */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(bool enabled);
+
+    void lap(const char *phase);
+
+    /* Seconds since the timer was created. */
+    double elapsed() const;
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    bool enabled;
+    clock::time_point start;
+    clock::time_point last;
+};
+
+/* Peak resident set size of the process in bytes, 0 where unsupported. */
+uint64_t get_peak_rss();